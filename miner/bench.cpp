@@ -0,0 +1,519 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include "momentum.hpp"
+#include "sha512_lanes.hpp"
+#include "hashtable.hpp"
+#include "table_memory.hpp"
+#include "header_hash.hpp"
+#include "work_message.hpp"
+#include <fc/time.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/io/datastream.hpp>
+#include <fc/variant.hpp>
+#include <fc/crypto/city.hpp>
+#include <boost/thread/thread.hpp>
+
+/**
+ *  momentum_bench, reproducible timing of momentum_search by stage
+ *
+ *  Every run searches the same fixed seeds, so two builds can be compared
+ *  number for number.  Stages are:
+ *
+ *    reset     preparing the table or buckets, from momentum_search_stats
+ *    hash      a separate pass that only computes birthdays with the same
+ *              hasher and thread count, nothing is stored
+ *    store     generate time of the search less the hash pass, the cost of
+ *              storing and probing the birthdays
+ *    resolve   collision pass of the bucket, bloom and sort engines
+ *    validate  momentum_verify and the share hash of every reported pair
+ */
+
+typedef std::vector< std::pair<uint32_t,uint32_t> > pair_list;
+
+struct bench_options
+{
+   bench_options():engine(TABLE_ENGINE),seeds(4),json(false),verify(false),stress_table(false),frames(false){}
+
+   momentum_engine        engine;
+   std::vector<uint32_t>  threads;
+   std::vector<uint64_t>  bloom_bytes;   ///< bloom engine filter sizes to compare
+   uint32_t               seeds;
+   bool                   json;
+   bool                   verify;
+   bool                   stress_table;
+   bool                   frames;
+};
+
+struct bench_result
+{
+   bench_result():threads(0),bytes(0),pairs(0),invalid(0),shares(0),nonces(0),search_us(0),reset_us(0),hash_us(0),
+                  store_us(0),resolve_us(0),validate_us(0){}
+
+   uint32_t threads;
+   uint64_t bytes;       ///< memory of one search instance
+   uint64_t pairs;
+   uint64_t invalid;
+   uint64_t shares;      ///< pairs that meet the pool share target
+   uint64_t nonces;      ///< nonces searched, less than seeds*MAX_MOMENTUM_NONCE with --depth
+   int64_t  search_us;
+   int64_t  reset_us;
+   int64_t  hash_us;
+   int64_t  store_us;
+   int64_t  resolve_us;
+   int64_t  validate_us;
+};
+
+pow_seed_type bench_seed( uint32_t i )
+{
+   pow_seed_type seed;
+   seed._hash[0] = i;
+   return seed;
+}
+
+/** a stand in for the block header of seed, only its hashing cost matters */
+std::vector<char> bench_header( const pow_seed_type& seed )
+{
+   std::vector<char> header( pair_header_hasher::HEADER_SIZE );
+   memcpy( header.data(), (const char*)&seed, sizeof(seed) );
+   return header;
+}
+
+/** hashes the first limit nonces of seed without storing anything */
+int64_t hash_pass( const pow_seed_type& seed, uint32_t threads, uint32_t limit )
+{
+   const birthday_midstate midstate( (const char*)&seed );
+   const birthday_hasher&  hasher = *get_birthday_hasher();
+   const uint32_t          group  = BIRTHDAYS_PER_HASH*hasher.lanes;
+   const uint32_t          share  = (limit/group + threads - 1) / threads * group;
+   std::vector<uint64_t>   sink( threads );
+
+   auto start = fc::time_point::now();
+   boost::thread_group workers;
+   for( uint32_t t = 0; t < threads; ++t )
+   {
+      workers.create_thread( [&,t](){
+         uint32_t nonces[MAX_HASH_LANES];
+         uint64_t digests[MAX_HASH_LANES*8];
+         const uint32_t last = std::min<uint32_t>( (t+1)*share, limit );
+         for( uint32_t i = std::min<uint32_t>( t*share, limit ); i < last; i += group )
+         {
+            for( uint32_t l = 0; l < hasher.lanes; ++l )
+               nonces[l] = i + l*BIRTHDAYS_PER_HASH;
+            hasher.hash( midstate, nonces, digests );
+            for( uint32_t d = 0; d < hasher.lanes*8; ++d )
+               sink[t] ^= digests[d] >> 14;
+         }
+      });
+   }
+   workers.join_all();
+   return (fc::time_point::now() - start).count();
+}
+
+bench_result run_bench( const bench_options& opts, uint32_t threads )
+{
+   bench_result r;
+   r.threads          = threads;
+   r.bytes            = momentum_search_bytes( opts.engine, threads );
+   get_thread_count() = threads;
+
+   // the first search allocates the table, keep that out of the numbers
+   momentum_search( bench_seed( opts.seeds ), 0, opts.engine );
+
+   for( uint32_t s = 0; s < opts.seeds; ++s )
+   {
+      const pow_seed_type seed = bench_seed( s );
+
+      auto start = fc::time_point::now();
+      pair_list pairs = momentum_search( seed, 0, opts.engine );
+      r.search_us += (fc::time_point::now() - start).count();
+
+      const momentum_search_stats& stats = get_momentum_search_stats( 0 );
+      const int64_t hash_us = hash_pass( seed, threads, stats.nonces );
+      r.reset_us   += stats.reset_us;
+      r.hash_us    += hash_us;
+      r.store_us   += std::max<int64_t>( 0, stats.generate_us - hash_us );
+      r.resolve_us += stats.resolve_us;
+      r.nonces     += stats.nonces;
+
+      start = fc::time_point::now();
+      const pair_header_hasher hasher( bench_header( seed ).data() );
+      for( auto itr = pairs.begin(); itr != pairs.end(); ++itr )
+      {
+         if( !momentum_verify( seed, itr->first, itr->second ) ) ++r.invalid;
+         const fc::sha256 result = hasher.hash( itr->first, itr->second );
+         if( ((const unsigned char*)&result)[31] < 0x03 ) ++r.shares;
+      }
+      r.validate_us += (fc::time_point::now() - start).count();
+      r.pairs       += pairs.size();
+   }
+   return r;
+}
+
+/** pairs found per minute, the number pool_miner reports as HPM */
+double hpm( const bench_result& r )
+{
+   return r.search_us ? r.pairs / (r.search_us / 60000000.0) : 0;
+}
+
+/** memory decides how many searches fit on a host */
+double hpm_per_gb( const bench_result& r )
+{
+   return hpm( r ) / (r.bytes / double(1ull << 30));
+}
+
+void print_text( const bench_options& opts, const std::vector<bench_result>& results )
+{
+   std::cout<<momentum_engine_name( opts.engine )<<" engine, "<<get_birthday_hasher()->name
+            <<" hasher, "<<opts.seeds<<" seeds, times in ms per search\n";
+   std::cout<<"threads       hpm    MB  hpm/GB    search     reset      hash     store   resolve  validate  pairs invalid\n";
+   for( auto itr = results.begin(); itr != results.end(); ++itr )
+   {
+      const double n = opts.seeds * 1000.0;
+      char line[256];
+      snprintf( line, sizeof(line), "%7u %9.1f %5llu %7.1f %9.1f %9.3f %9.1f %9.1f %9.1f %9.3f %6llu %7llu\n",
+                itr->threads, hpm( *itr ), (unsigned long long)(itr->bytes >> 20),
+                hpm_per_gb( *itr ), itr->search_us/n, itr->reset_us/n, itr->hash_us/n,
+                itr->store_us/n, itr->resolve_us/n, itr->validate_us/n,
+                (unsigned long long)itr->pairs, (unsigned long long)itr->invalid );
+      std::cout<<line;
+   }
+}
+
+void print_json( const bench_options& opts, const std::vector<bench_result>& results )
+{
+   std::cout<<"{\"engine\":\""<<momentum_engine_name( opts.engine )<<"\""
+            <<",\"hasher\":\""<<get_birthday_hasher()->name<<"\""
+            <<",\"table_pages\":\""<<table_page_policy_name( get_table_memory_policy().pages )<<"\""
+            <<",\"seeds\":"<<opts.seeds<<",\"results\":[";
+   for( uint32_t i = 0; i < results.size(); ++i )
+   {
+      const bench_result& r = results[i];
+      std::cout<<(i ? "," : "")
+               <<"{\"threads\":"<<r.threads<<",\"hpm\":"<<hpm( r )
+               <<",\"search_bytes\":"<<r.bytes<<",\"hpm_per_gb\":"<<hpm_per_gb( r )
+               <<",\"pairs\":"<<r.pairs<<",\"invalid\":"<<r.invalid<<",\"shares\":"<<r.shares<<",\"nonces\":"<<r.nonces
+               <<",\"search_us\":"<<r.search_us<<",\"reset_us\":"<<r.reset_us
+               <<",\"hash_us\":"<<r.hash_us<<",\"store_us\":"<<r.store_us
+               <<",\"resolve_us\":"<<r.resolve_us<<",\"validate_us\":"<<r.validate_us<<"}";
+   }
+   std::cout<<"]}\n";
+}
+
+/**
+ *  Checks every backend against the sphlib reference, then searches each
+ *  seed with every engine.  Every pair must pass momentum_verify, and since
+ *  the table engines may lose entries but never invent them, their pairs
+ *  must be a subset of the bucket engine's.  The sort engine loses nothing
+ *  and must match it exactly.
+ *
+ *  @return 0 if everything matched
+ */
+int verify_mode( const bench_options& opts )
+{
+   int failures = 0;
+   const pow_seed_type     seed0 = bench_seed( 0 );
+   const birthday_midstate midstate( (const char*)&seed0 );
+   const char* names[] = { "avx512", "avx2", "sse2", "scalar" };
+   for( uint32_t n = 0; n < sizeof(names)/sizeof(names[0]); ++n )
+   {
+      const birthday_hasher* hasher = find_birthday_hasher( names[n] );
+      if( !hasher ) continue;
+      uint32_t mismatched = 0;
+      for( uint32_t i = 0; i < MAX_MOMENTUM_NONCE; i += 65536 + BIRTHDAYS_PER_HASH*hasher->lanes )
+      {
+         uint32_t nonces[MAX_HASH_LANES];
+         uint64_t digests[MAX_HASH_LANES*8];
+         uint64_t reference[8];
+         for( uint32_t l = 0; l < hasher->lanes; ++l )
+            nonces[l] = i + l*BIRTHDAYS_PER_HASH;
+         hasher->hash( midstate, nonces, digests );
+         for( uint32_t l = 0; l < hasher->lanes; ++l )
+         {
+            birthday_hasher_sphlib()->hash( midstate, nonces + l, reference );
+            mismatched += memcmp( reference, digests + l*8, sizeof(reference) ) != 0;
+         }
+      }
+      std::cerr<<"hasher "<<names[n]<<": "<<(mismatched ? "MISMATCH\n" : "ok\n");
+      failures += mismatched != 0;
+   }
+
+   for( uint32_t s = 0; s < opts.seeds; ++s )
+   {
+      const pow_seed_type seed = bench_seed( s );
+      pair_list found[SORT_ENGINE+1];
+      for( int e = TABLE_ENGINE; e <= SORT_ENGINE; ++e )
+      {
+         found[e] = momentum_search( seed, 0, momentum_engine(e) );
+         uint64_t invalid = 0;
+         for( auto itr = found[e].begin(); itr != found[e].end(); ++itr )
+            invalid += !momentum_verify( seed, itr->first, itr->second );
+         std::sort( found[e].begin(), found[e].end() );
+         std::cerr<<"seed "<<s<<" "<<momentum_engine_name( momentum_engine(e) )<<": "
+                  <<found[e].size()<<" pairs, "<<invalid<<" invalid\n";
+         failures += invalid != 0;
+      }
+      if( found[SORT_ENGINE] != found[BUCKET_ENGINE] )
+      {
+         std::cerr<<"seed "<<s<<": the sort and bucket engines found different pairs\n";
+         ++failures;
+      }
+      for( int e = TABLE_ENGINE; e <= BLOOM_ENGINE; ++e )
+      {
+         if( e != BUCKET_ENGINE &&
+             !std::includes( found[BUCKET_ENGINE].begin(), found[BUCKET_ENGINE].end(), found[e].begin(), found[e].end() ) )
+         {
+            std::cerr<<"seed "<<s<<": "<<momentum_engine_name( momentum_engine(e) )
+                     <<" engine found pairs the bucket engine missed\n";
+            ++failures;
+         }
+      }
+   }
+   return failures ? -1 : 0;
+}
+
+/**
+ *  Stores every key from several threads at once, with the copies of each
+ *  key handed to different threads back to back, and checks the collisions
+ *  the concurrent table reports against the exact count.
+ *
+ *  Every copy after the first of a key is a collision.  An eviction drops
+ *  one entry, which costs at most the collision of the next copy of that
+ *  key, so a run may come short of the exact count by no more than its
+ *  evictions and must never exceed it.
+ *
+ *  @return 0 if no collision was lost beyond the evictions
+ */
+int table_stress( uint32_t threads )
+{
+    const uint32_t copies = 4;
+    const uint32_t keys   = 1 << 23;
+    auto key_of = []( uint32_t position ) -> uint64_t {
+        uint32_t k = position / copies;
+        return (fc::city_hash64( (char*)&k, sizeof(k) ) >> 14) | 1;
+    };
+
+    std::vector<uint64_t> distinct( keys );
+    for( uint32_t k = 0; k < keys; ++k )
+       distinct[k] = key_of( k*copies );
+    std::sort( distinct.begin(), distinct.end() );
+    const uint64_t reference = uint64_t(keys)*copies - (std::unique( distinct.begin(), distinct.end() ) - distinct.begin());
+    distinct = std::vector<uint64_t>();
+
+    std::unique_ptr<concurrent_hashtable> table( new concurrent_hashtable() );
+
+    int failures = 0;
+    for( uint32_t run = 0; run < 8; ++run )
+    {
+       table->reset();
+       std::vector<uint64_t> found( threads );
+       boost::thread_group group;
+       for( uint32_t t = 0; t < threads; ++t )
+       {
+          group.create_thread( [&,t](){
+             for( uint32_t p = t; p < keys*copies; p += threads )
+                if( table->store( key_of(p), p ) != uint32_t(-1) ) ++found[t];
+          });
+       }
+       group.join_all();
+
+       uint64_t total = 0;
+       for( uint32_t t = 0; t < threads; ++t ) total += found[t];
+       bool ok = total <= reference && total + table->evictions() >= reference;
+       failures += !ok;
+       std::cerr<<"run "<<run<<": threads "<<threads<<"  collisions "<<total<<"  reference "<<reference
+                <<"  evictions "<<table->evictions()<<(ok ? "  ok\n" : "  LOST COLLISIONS\n");
+    }
+    return failures ? -1 : 0;
+}
+
+/**
+ *  Round trips work messages through their 192 byte frame on every thread,
+ *  once in place with work_frame and once through fc::raw the way the wire
+ *  path did before, and prints frames per second per thread of each.
+ *
+ *  @return 0 if both gave back the message that went in
+ */
+int frame_bench( uint32_t threads )
+{
+    const uint32_t rounds = 1 << 21;
+
+    work_message sample;
+    sample.header.version = 1;
+    sample.user.valid     = 12345;
+    sample.pool_shares    = 67890;
+    sample.pool_spm       = 1.5f;
+    sample.ptsaddr        = "PmnhHW6AAnbJTpc9dxyJYpp1Fg4VZoUnMF";
+
+    // each thread encodes and decodes its own copy, the nonce changes every round
+    auto run = [&]( bool in_place ) -> double {
+        std::vector<uint64_t> bad( threads );
+        auto start = fc::time_point::now();
+        boost::thread_group group;
+        for( uint32_t t = 0; t < threads; ++t )
+        {
+           group.create_thread( [&,t](){
+              work_message in = sample;
+              work_message out;
+              work_frame   frame;
+              for( uint32_t r = 0; r < rounds; ++r )
+              {
+                 in.header.nonce = r;
+                 if( in_place )
+                 {
+                    frame.encode( in );
+                    frame.decode( out );
+                 }
+                 else
+                 {
+                    auto data = fc::raw::pack( in );
+                    data.resize( work_frame::SIZE );
+                    fc::datastream<const char*> ds( data.data(), data.size() );
+                    fc::raw::unpack( ds, out );
+                 }
+                 bad[t] += out.header.nonce != r;
+              }
+              bad[t] += out.ptsaddr != in.ptsaddr || out.user.valid != in.user.valid || out.pool_spm != in.pool_spm;
+           });
+        }
+        group.join_all();
+        const int64_t us = (fc::time_point::now() - start).count();
+        uint64_t failures = 0;
+        for( uint32_t t = 0; t < threads; ++t ) failures += bad[t];
+        return failures ? -1 : double(rounds) * 1000000.0 / std::max<int64_t>( us, 1 );
+    };
+
+    const double in_place = run( true );
+    const double packed   = run( false );
+    std::cerr<<"threads "<<threads<<"  work_frame "<<in_place<<" frames/s per thread"
+             <<"  fc::raw "<<packed<<" frames/s per thread\n";
+    return in_place < 0 || packed < 0 ? -1 : 0;
+}
+
+/** parses a comma separated list of thread counts */
+bool parse_thread_list( const std::string& value, std::vector<uint32_t>& threads )
+{
+   std::stringstream ss( value );
+   std::string item;
+   threads.clear();
+   while( std::getline( ss, item, ',' ) )
+   {
+      if( item.empty() || item.find_first_not_of( "0123456789" ) != std::string::npos ) return false;
+      uint32_t t = fc::variant( item ).as_uint64();
+      if( t == 0 ) return false;
+      threads.push_back( t );
+   }
+   return !threads.empty();
+}
+
+/** parses a comma separated list of byte sizes */
+bool parse_byte_list( const std::string& value, std::vector<uint64_t>& sizes )
+{
+   std::stringstream ss( value );
+   std::string item;
+   sizes.clear();
+   while( std::getline( ss, item, ',' ) )
+   {
+      uint64_t bytes;
+      if( !parse_byte_size( item, bytes ) || bytes == 0 ) return false;
+      sizes.push_back( bytes );
+   }
+   return !sizes.empty();
+}
+
+bool parse_options( int argc, char** argv, bench_options& opts )
+{
+    for( int i = 1; i < argc; ++i )
+    {
+       std::string arg = argv[i];
+       auto eq = arg.find( '=' );
+       std::string name  = arg.substr( 0, eq );
+       std::string value = eq == std::string::npos ? std::string() : arg.substr( eq+1 );
+       if( name == "--engine" && parse_momentum_engine( value, opts.engine ) )
+          continue;
+       if( name == "--threads" && parse_thread_list( value, opts.threads ) )
+          continue;
+       if( name == "--seeds" && !value.empty() && value.find_first_not_of( "0123456789" ) == std::string::npos )
+       {
+          opts.seeds = fc::variant( value ).as_uint64();
+          continue;
+       }
+       if( name == "--hasher" && find_birthday_hasher( value.c_str() ) )
+       {
+          get_birthday_hasher() = find_birthday_hasher( value.c_str() );
+          continue;
+       }
+       if( name == "--depth" && parse_momentum_depth( value, get_momentum_depth() ) )
+          continue;
+       if( name == "--table-pages" && parse_table_page_policy( value, get_table_memory_policy().pages ) )
+          continue;
+       if( name == "--cuckoo-memory" && parse_byte_size( value, get_cuckoo_table_bytes() ) )
+          continue;
+       if( name == "--bloom-memory" && parse_byte_list( value, opts.bloom_bytes ) )
+          continue;
+       if( name == "--json" )         { opts.json = true;         continue; }
+       if( name == "--verify" )       { opts.verify = true;       continue; }
+       if( name == "--stress-table" ) { opts.stress_table = true; continue; }
+       if( name == "--frames" )       { opts.frames = true;       continue; }
+       std::cerr<<"Invalid option "<<arg<<"\n";
+       return false;
+    }
+    return true;
+}
+
+int main( int argc, char** argv )
+{
+    bench_options opts;
+    if( !parse_options( argc, argv, opts ) )
+    {
+       std::cerr<<"Usage: "<<argv[0]<<" [--engine=table|bucket|cuckoo|bloom|sort] [--threads=1,2,4] [--seeds=N]\n"
+                <<"       [--hasher=avx512|avx2|sse2|scalar|sphlib] [--table-pages=small|thp|2m|1g]\n"
+                <<"       [--depth=full|auto|NONCES] [--cuckoo-memory=BYTES[K|M|G]]\n"
+                <<"       [--bloom-memory=BYTES[K|M|G],...]\n"
+                <<"       [--json] [--verify] [--stress-table] [--frames]\n";
+       return -1;
+    }
+    if( opts.threads.empty() )
+       opts.threads.push_back( get_thread_count() );
+
+    if( opts.stress_table )
+    {
+       int failures = 0;
+       for( auto itr = opts.threads.begin(); itr != opts.threads.end(); ++itr )
+          failures += table_stress( *itr ) != 0;
+       return failures ? -1 : 0;
+    }
+    if( opts.frames )
+    {
+       int failures = 0;
+       for( auto itr = opts.threads.begin(); itr != opts.threads.end(); ++itr )
+          failures += frame_bench( *itr ) != 0;
+       return failures ? -1 : 0;
+    }
+    if( opts.bloom_bytes.empty() )
+       opts.bloom_bytes.push_back( get_bloom_filter_bytes() );
+    if( opts.verify )
+    {
+       get_thread_count()       = opts.threads.front();
+       get_bloom_filter_bytes() = opts.bloom_bytes.front();
+       return verify_mode( opts );
+    }
+
+    // a list of filter sizes shows where the bloom engine overtakes the table on this host
+    std::vector<bench_result> results;
+    for( auto size = opts.bloom_bytes.begin(); size != opts.bloom_bytes.end(); ++size )
+    {
+       get_bloom_filter_bytes() = *size;
+       for( auto itr = opts.threads.begin(); itr != opts.threads.end(); ++itr )
+          results.push_back( run_bench( opts, *itr ) );
+       if( opts.engine != BLOOM_ENGINE ) break;
+    }
+
+    if( opts.json ) print_json( opts, results );
+    else            print_text( opts, results );
+
+    for( auto itr = results.begin(); itr != results.end(); ++itr )
+       if( itr->invalid ) return -1;
+    return 0;
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+/**
+ *  Radix partitioned birthday store for the bucket engine.
+ *
+ *  Phase 1: every search thread scatters its (birthday, nonce) records into
+ *  its own region, split into BUCKET_COUNT buckets by the top bits of the
+ *  birthday, so no cache line is ever shared between threads.
+ *
+ *  Phase 2: each bucket is gathered from all regions and its collisions are
+ *  found with a small open addressing table that stays in L2.
+ *
+ *  A record packs the birthday bits below the bucket index with the nonce
+ *  into one word, 0 marks an empty slot so nonce 0 (which momentum_verify
+ *  rejects anyway) is never stored.
+ */
+class birthday_buckets
+{
+   public:
+      enum
+      {
+         BIRTHDAY_BITS = 50,
+         NONCE_BITS    = 26,
+         BUCKET_BITS   = 12,
+         BUCKET_COUNT  = 1 << BUCKET_BITS,
+         KEY_BITS      = BIRTHDAY_BITS - BUCKET_BITS
+      };
+
+      birthday_buckets():threads(0),capacity(0){}
+
+      /**
+       *  records per thread per bucket, the expected number plus eight
+       *  standard deviations, overflow past that is dropped and counted
+       */
+      static uint32_t capacity_for( uint32_t thread_count )
+      {
+         const double expected = double(1<<NONCE_BITS) / thread_count / BUCKET_COUNT;
+         return uint32_t( expected + 8*sqrt(expected) + 16 );
+      }
+
+      /** memory reset( thread_count ) allocates */
+      static uint64_t bytes_for( uint32_t thread_count )
+      {
+         return uint64_t(thread_count)*BUCKET_COUNT*( capacity_for( thread_count )*sizeof(uint64_t) + sizeof(uint32_t) );
+      }
+
+      /** prepares regions for a search with thread_count writers */
+      void reset( uint32_t thread_count )
+      {
+         if( thread_count != threads )
+         {
+            threads  = thread_count;
+            capacity = capacity_for( thread_count );
+            std::vector<uint64_t>( size_t(threads)*BUCKET_COUNT*capacity ).swap( records );
+            std::vector<uint32_t>( size_t(threads)*BUCKET_COUNT ).swap( counts );
+         }
+         memset( counts.data(), 0, counts.size()*sizeof(uint32_t) );
+         lost.assign( threads, 0 );
+      }
+
+      /** phase 1, only ever called by thread for its own region */
+      void scatter( uint32_t thread, uint64_t birthday, uint32_t nonce )
+      {
+         if( nonce == 0 ) return;
+         const size_t   region = size_t(thread)*BUCKET_COUNT + (birthday >> KEY_BITS);
+         uint32_t&      count  = counts[region];
+         if( count == capacity ) { ++lost[thread]; return; }
+         records[region*capacity + count++] = (birthday << NONCE_BITS) | nonce;
+      }
+
+      /**
+       *  phase 2, appends every colliding pair in bucket in both orders.  Like
+       *  hashtable::store the first nonce seen for a birthday is kept, so a
+       *  triple collision yields (a,b) and (a,c).
+       *
+       *  @param scratch per thread working table, reused between calls
+       */
+      void resolve( uint32_t bucket, std::vector<uint64_t>& scratch,
+                    std::vector< std::pair<uint32_t,uint32_t> >& results )
+      {
+         uint32_t total = 0;
+         for( uint32_t t = 0; t < threads; ++t )
+            total += counts[size_t(t)*BUCKET_COUNT + bucket];
+
+         uint32_t slots = 1024;
+         while( slots < 2*total ) slots <<= 1;
+         if( scratch.size() < slots ) scratch.resize( slots );
+         memset( scratch.data(), 0, slots*sizeof(uint64_t) );
+         const uint64_t mask = slots - 1;
+
+         for( uint32_t t = 0; t < threads; ++t )
+         {
+            const size_t    region = size_t(t)*BUCKET_COUNT + bucket;
+            const uint64_t* rec    = &records[region*capacity];
+            const uint64_t* end    = rec + counts[region];
+            for( ; rec != end; ++rec )
+            {
+               const uint64_t key = *rec >> NONCE_BITS;
+               for( uint64_t i = key & mask; ; i = (i+1) & mask )
+               {
+                  if( scratch[i] == 0 )
+                  {
+                     scratch[i] = *rec;
+                     break;
+                  }
+                  if( (scratch[i] >> NONCE_BITS) == key )
+                  {
+                     const uint32_t a = uint32_t(scratch[i] & ((1<<NONCE_BITS)-1));
+                     const uint32_t b = uint32_t(*rec & ((1<<NONCE_BITS)-1));
+                     results.push_back( std::make_pair( a, b ) );
+                     results.push_back( std::make_pair( b, a ) );
+                     break;
+                  }
+               }
+            }
+         }
+      }
+
+      /** records dropped by full regions during the last search */
+      uint64_t dropped()const
+      {
+         uint64_t d = 0;
+         for( size_t i = 0; i < lost.size(); ++i )
+            d += lost[i];
+         return d;
+      }
+
+   private:
+      uint32_t                threads;
+      uint32_t                capacity;
+      std::vector<uint64_t>   records;
+      std::vector<uint64_t>   lost;
+      std::vector<uint32_t>   counts;
+};
@@ -0,0 +1,101 @@
+#pragma once
+#include <string.h>
+#include <stdint.h>
+
+/**
+ *  Digests of recently verified birthday groups, keyed by the 32 byte head
+ *  and the first nonce of the group.  Miners that resubmit the same header
+ *  with other pairs, or send pairs from one group, skip the SHA-512.
+ *
+ *  Set associative with LRU replacement inside each set.  Not thread safe,
+ *  every verify thread keeps its own.
+ */
+class birthday_cache
+{
+   public:
+      enum
+      {
+         SET_BITS = 8,
+         SETS     = 1 << SET_BITS,
+         WAYS     = 4
+      };
+
+      birthday_cache():generation(0){ clear(); }
+
+      /** forgets everything if generation differs from the one last seen */
+      void sync( uint32_t current )
+      {
+         if( current != generation )
+         {
+            clear();
+            generation = current;
+         }
+      }
+
+      bool find( const char* head, uint32_t index, uint64_t digest[8] )
+      {
+         entry* set = sets[ set_of( head, index ) ];
+         for( uint32_t w = 0; w < WAYS; ++w )
+         {
+            if( set[w].stamp && set[w].index == index && memcmp( set[w].head, head, sizeof(set[w].head) ) == 0 )
+            {
+               memcpy( digest, set[w].digest, sizeof(set[w].digest) );
+               set[w].stamp = next_stamp();
+               return true;
+            }
+         }
+         return false;
+      }
+
+      void insert( const char* head, uint32_t index, const uint64_t digest[8] )
+      {
+         const uint32_t stamp = next_stamp();
+         entry* set    = sets[ set_of( head, index ) ];
+         entry* oldest = set;
+         for( uint32_t w = 1; w < WAYS; ++w )
+            if( set[w].stamp < oldest->stamp ) oldest = set + w;
+
+         memcpy( oldest->head, head, sizeof(oldest->head) );
+         memcpy( oldest->digest, digest, sizeof(oldest->digest) );
+         oldest->index = index;
+         oldest->stamp = stamp;
+      }
+
+      void clear()
+      {
+         memset( sets, 0, sizeof(sets) );
+         clock = 0;
+      }
+
+   private:
+      /** starts over rather than let the LRU order wrap */
+      uint32_t next_stamp()
+      {
+         if( ++clock == 0 )
+         {
+            clear();
+            clock = 1;
+         }
+         return clock;
+      }
+
+      struct entry
+      {
+         char     head[32];
+         uint64_t digest[8];
+         uint32_t index;
+         uint32_t stamp;   ///< 0 marks an empty way
+      };
+
+      /** heads are hash outputs, so any of their bits make a good set index */
+      static uint32_t set_of( const char* head, uint32_t index )
+      {
+         uint32_t h;
+         memcpy( &h, head, sizeof(h) );
+         return (h ^ (index * 0x9e3779b1u)) >> (32 - SET_BITS);
+      }
+
+      entry    sets[SETS][WAYS];
+      uint32_t generation;
+      uint32_t clock;
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include "table_memory.hpp"
+#include <atomic>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ *  Register blocked Bloom filter of birthdays for the bloom engine.
+ *
+ *  A birthday maps to one 64 bit word and sets PROBES bits inside it, so an
+ *  insert is a single fetch_or that also tells whether every bit was set
+ *  already.  Two threads inserting the same birthday therefore always see
+ *  each other, whichever comes second gets true.
+ *
+ *  Birthdays are hash output, the seed only keeps the word and bits chosen
+ *  by two filters over the same birthdays independent.
+ */
+class birthday_filter
+{
+   public:
+      enum
+      {
+         PROBES     = 4,
+         PROBE_BITS = 6,   ///< bits that pick one of 64
+         MIN_BITS   = 10   ///< words of the smallest filter, 8 KB
+      };
+
+      /** @param bytes rounded down to a power of two of at least 8 KB */
+      birthday_filter( uint64_t bytes, uint64_t seed ) :
+         word_bits( word_bits_for( bytes ) ),
+         seed(seed),
+         memory( size_t(8) << word_bits ),
+         table( (std::atomic<uint64_t>*)memory.data() )
+      {
+         static_assert( sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "words are cleared with memset" );
+         clear();
+      }
+
+      /** @return memory a filter created with bytes actually uses */
+      static uint64_t bytes_for( uint64_t bytes ) { return uint64_t(8) << word_bits_for( bytes ); }
+
+      uint64_t size()const { return uint64_t(8) << word_bits; }
+
+      /** not thread safe, only call between searches */
+      void clear()
+      {
+         memset( (char*)table, 0, size() );
+      }
+
+      /** @return true if birthday, or one sharing all its bits, was inserted before */
+      bool insert( uint64_t birthday )
+      {
+         uint64_t bits;
+         std::atomic<uint64_t>& word = locate( birthday, bits );
+         return (word.fetch_or( bits, std::memory_order_relaxed ) & bits) == bits;
+      }
+
+      bool contains( uint64_t birthday )const
+      {
+         uint64_t bits;
+         const std::atomic<uint64_t>& word = const_cast<birthday_filter*>(this)->locate( birthday, bits );
+         return (word.load( std::memory_order_relaxed ) & bits) == bits;
+      }
+
+   private:
+      birthday_filter( const birthday_filter& );
+      birthday_filter& operator=( const birthday_filter& );
+
+      static uint32_t word_bits_for( uint64_t bytes )
+      {
+         uint32_t bits = MIN_BITS;
+         while( bits < 64 - PROBES*PROBE_BITS && (uint64_t(8) << (bits+1)) <= bytes ) ++bits;
+         return bits;
+      }
+
+      /** the top bits of the product pick the word, the ones below them the bits */
+      std::atomic<uint64_t>& locate( uint64_t birthday, uint64_t& bits )
+      {
+         const uint64_t h = (birthday ^ seed) * 0x9e3779b97f4a7c15ull;
+         uint64_t probes  = h >> (64 - word_bits - PROBES*PROBE_BITS);
+         bits = 0;
+         for( uint32_t p = 0; p < PROBES; ++p, probes >>= PROBE_BITS )
+            bits |= uint64_t(1) << (probes & 63);
+         return table[ h >> (64 - word_bits) ];
+      }
+
+      const uint32_t         word_bits;
+      const uint64_t         seed;
+      table_memory           memory;
+      std::atomic<uint64_t>* table;
+};
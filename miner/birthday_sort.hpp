@@ -0,0 +1,196 @@
+#pragma once
+#include "table_memory.hpp"
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ *  Flat array of every (birthday, nonce) record of a search for the sort
+ *  engine, ordered with a parallel LSD radix sort so that equal birthdays
+ *  end up next to each other.
+ *
+ *  A record packs the top KEY_BITS of the birthday with the nonce into one
+ *  word.  Records with equal keys are only candidates that the caller
+ *  confirms with the full birthday, among 2^26 records about 2^13 of them
+ *  are false, a negligible number of extra hashes.
+ *
+ *  Only the top PASSES*DIGIT_BITS key bits are sorted on.  That is enough
+ *  to bring equal keys into one group, and scan() compares the records of
+ *  each group pairwise.  Every pass is stable, each thread counts its slice
+ *  of the input, the counts become per thread output offsets, and each
+ *  thread then streams its slice out to the other array.
+ *
+ *  count(), scatter() and scan() poll cancel every CANCEL_RECORDS records,
+ *  a pass over all 2^26 records takes far too long to finish first.  The
+ *  records are left half sorted then and only good for another reset().
+ */
+class birthday_sort
+{
+   public:
+      enum
+      {
+         BIRTHDAY_BITS = 50,
+         NONCE_BITS    = 26,
+         KEY_BITS      = 64 - NONCE_BITS,
+         DIGIT_BITS    = 12,
+         DIGITS        = 1 << DIGIT_BITS,
+         PASSES        = 3,
+         SORT_SHIFT    = 64 - PASSES*DIGIT_BITS,
+         CANCEL_RECORDS = 1 << 12
+      };
+
+      birthday_sort():threads(0){}
+
+      /** memory of the two record arrays */
+      static uint64_t bytes_for() { return 2*(uint64_t(1) << NONCE_BITS)*sizeof(uint64_t); }
+
+      /**
+       *  Prepares for a search where thread t stores the birthdays of nonces
+       *  starting at t*share, no more than share of them.
+       */
+      void reset( uint32_t thread_count, uint32_t share )
+      {
+         if( !memory[0] )
+         {
+            memory[0].reset( new table_memory( bytes_for() / 2 ) );
+            memory[1].reset( new table_memory( bytes_for() / 2 ) );
+         }
+         src = (uint64_t*)memory[0]->data();
+         dst = (uint64_t*)memory[1]->data();
+
+         threads = thread_count;
+         begin.resize( threads );
+         end.resize( threads );
+         for( uint32_t t = 0; t < threads; ++t )
+            begin[t] = end[t] = std::min<uint64_t>( uint64_t(t)*share, uint64_t(1) << NONCE_BITS );
+         offsets.assign( size_t(threads)*DIGITS, 0 );
+      }
+
+      /** only ever called by thread for the nonces it was given */
+      void store( uint32_t thread, uint64_t birthday, uint32_t nonce )
+      {
+         if( nonce == 0 ) return;
+         src[end[thread]++] = ((birthday >> (BIRTHDAY_BITS - KEY_BITS)) << NONCE_BITS) | nonce;
+      }
+
+      /**
+       *  First step of a pass, thread counts the digits of its slice.
+       *
+       *  @return false if canceled
+       */
+      template<typename Cancel>
+      bool count( uint32_t pass, uint32_t thread, const Cancel& cancel )
+      {
+         uint64_t* counts = &offsets[size_t(thread)*DIGITS];
+         memset( counts, 0, DIGITS*sizeof(uint64_t) );
+         const uint32_t shift = SORT_SHIFT + pass*DIGIT_BITS;
+         for( uint64_t block = begin[thread]; block < end[thread]; block += CANCEL_RECORDS )
+         {
+            if( cancel.canceled() ) return false;
+            const uint64_t last = std::min<uint64_t>( block + CANCEL_RECORDS, end[thread] );
+            for( uint64_t i = block; i < last; ++i )
+               ++counts[ (src[i] >> shift) & (DIGITS-1) ];
+         }
+         return true;
+      }
+
+      /** between the steps, turns the counts into the output index of every thread and digit */
+      void prefix()
+      {
+         uint64_t next = 0;
+         for( uint32_t d = 0; d < DIGITS; ++d )
+         {
+            for( uint32_t t = 0; t < threads; ++t )
+            {
+               uint64_t& o = offsets[size_t(t)*DIGITS + d];
+               const uint64_t n = o;
+               o     = next;
+               next += n;
+            }
+         }
+      }
+
+      /**
+       *  Second step of a pass, thread moves its slice to the other array.
+       *
+       *  @return false if canceled
+       */
+      template<typename Cancel>
+      bool scatter( uint32_t pass, uint32_t thread, const Cancel& cancel )
+      {
+         uint64_t* next = &offsets[size_t(thread)*DIGITS];
+         const uint32_t shift = SORT_SHIFT + pass*DIGIT_BITS;
+         for( uint64_t block = begin[thread]; block < end[thread]; block += CANCEL_RECORDS )
+         {
+            if( cancel.canceled() ) return false;
+            const uint64_t last = std::min<uint64_t>( block + CANCEL_RECORDS, end[thread] );
+            for( uint64_t i = block; i < last; ++i )
+               dst[ next[ (src[i] >> shift) & (DIGITS-1) ]++ ] = src[i];
+         }
+         return true;
+      }
+
+      /** after every thread scattered, the output is the next input, split evenly */
+      void flip()
+      {
+         uint64_t total = 0;
+         for( uint32_t t = 0; t < threads; ++t )
+            total += end[t] - begin[t];
+         std::swap( src, dst );
+         for( uint32_t t = 0; t < threads; ++t )
+         {
+            begin[t] = total * t / threads;
+            end[t]   = total * (t+1) / threads;
+         }
+      }
+
+      /**
+       *  Calls candidate( a, b ) for every two nonces whose keys are equal,
+       *  for the groups that start in thread's slice of the sorted records.
+       *
+       *  @return false if canceled
+       */
+      template<typename Cancel, typename Candidate>
+      bool scan( uint32_t thread, const Cancel& cancel, Candidate candidate )const
+      {
+         const uint64_t last  = end[threads-1];
+         uint64_t       first = begin[thread];
+         // a group that started in the previous slice belongs to that thread
+         while( first > 0 && first < end[thread] && group( src[first] ) == group( src[first-1] ) )
+            ++first;
+         uint64_t check = first;
+         for( uint64_t i = first; i < end[thread]; )
+         {
+            if( i >= check )
+            {
+               if( cancel.canceled() ) return false;
+               check = i + CANCEL_RECORDS;
+            }
+            uint64_t j = i + 1;
+            while( j < last && group( src[j] ) == group( src[i] ) ) ++j;
+            for( uint64_t a = i; a + 1 < j; ++a )
+               for( uint64_t b = a + 1; b < j; ++b )
+                  if( (src[a] >> NONCE_BITS) == (src[b] >> NONCE_BITS) )
+                     candidate( nonce( src[a] ), nonce( src[b] ) );
+            i = j;
+         }
+         return true;
+      }
+
+   private:
+      birthday_sort( const birthday_sort& );
+      birthday_sort& operator=( const birthday_sort& );
+
+      static uint64_t group( uint64_t record ) { return record >> SORT_SHIFT; }
+      static uint32_t nonce( uint64_t record ) { return uint32_t( record & ((uint64_t(1)<<NONCE_BITS)-1) ); }
+
+      uint32_t                      threads;
+      std::unique_ptr<table_memory> memory[2];
+      uint64_t*                     src;
+      uint64_t*                     dst;
+      std::vector<uint64_t>         begin;     ///< slice of src each thread works on
+      std::vector<uint64_t>         end;
+      std::vector<uint64_t>         offsets;   ///< counts, then output indices, per thread and digit
+};
@@ -0,0 +1,155 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ *  Remembers the ids of recently submitted shares in fixed memory.
+ *
+ *  Ids are split over STRIPES by their top bits, each stripe has its own
+ *  lock and a pair of open addressing tables.  New ids go to the current
+ *  table, once it holds its share of the window the older table is emptied
+ *  and takes its place, so every stripe remembers between one and two
+ *  windows worth of ids.
+ *
+ *  Within that the answer is exact.  The only false positives are two
+ *  different shares with the same 64 bit id, the cost of the window is the
+ *  ids forgotten on rotation, whose resubmission is no longer caught.
+ */
+class duplicate_detector
+{
+   public:
+      enum
+      {
+         STRIPE_BITS = 6,
+         STRIPES     = 1 << STRIPE_BITS
+      };
+
+      struct counters
+      {
+         counters():checked(0),duplicates(0),rotations(0),forgotten(0){}
+
+         uint64_t checked;
+         uint64_t duplicates;
+         uint64_t rotations;
+         uint64_t forgotten;
+      };
+
+      /** @param window ids every stripe together remembers at least */
+      explicit duplicate_detector( uint64_t window )
+      {
+         const uint64_t limit = std::max<uint64_t>( 1, window / STRIPES );
+         uint64_t size = 2;
+         while( size < 2*limit ) size <<= 1;   // at most half full
+         for( uint32_t s = 0; s < STRIPES; ++s )
+            stripes.push_back( std::unique_ptr<stripe>( new stripe( size, limit ) ) );
+      }
+
+      /** @return memory used by the tables */
+      uint64_t bytes()const { return uint64_t(STRIPES) * 2 * (stripes[0]->mask+1) * sizeof(uint64_t); }
+
+      /** @return true the first time id is seen since it was last forgotten */
+      bool insert( uint64_t id )
+      {
+         if( id == 0 ) id = 1;   // 0 marks an empty slot
+         stripe& s = *stripes[ id >> (64 - STRIPE_BITS) ];
+         std::lock_guard<std::mutex> lock( s.lock );
+         ++s.stats.checked;
+
+         uint64_t* current = s.tables[s.current].data();
+         uint64_t  slot    = s.find( current, id );
+         if( current[slot] == id || s.contains( s.tables[s.current^1].data(), id ) )
+         {
+            ++s.stats.duplicates;
+            return false;
+         }
+
+         current[slot] = id;
+         if( ++s.used == s.limit ) s.rotate();
+         return true;
+      }
+
+      /** forgets every id, for a new block */
+      void clear()
+      {
+         for( uint32_t i = 0; i < STRIPES; ++i )
+         {
+            stripe& s = *stripes[i];
+            std::lock_guard<std::mutex> lock( s.lock );
+            s.clear( 0 );
+            s.clear( 1 );
+            s.used          = 0;
+            s.previous_used = 0;
+         }
+      }
+
+      counters get_counters()const
+      {
+         counters total;
+         for( uint32_t i = 0; i < STRIPES; ++i )
+         {
+            stripe& s = *stripes[i];
+            std::lock_guard<std::mutex> lock( s.lock );
+            total.checked    += s.stats.checked;
+            total.duplicates += s.stats.duplicates;
+            total.rotations  += s.stats.rotations;
+            total.forgotten  += s.stats.forgotten;
+         }
+         return total;
+      }
+
+   private:
+      duplicate_detector( const duplicate_detector& );
+      duplicate_detector& operator=( const duplicate_detector& );
+
+      struct stripe
+      {
+         stripe( uint64_t size, uint64_t limit ):mask(size-1),limit(limit),used(0),previous_used(0),current(0)
+         {
+            tables[0].assign( size, 0 );
+            tables[1].assign( size, 0 );
+         }
+
+         /** @return the slot holding id, or the empty slot where it belongs */
+         uint64_t find( const uint64_t* table, uint64_t id )const
+         {
+            uint64_t slot = id & mask;
+            while( table[slot] && table[slot] != id ) slot = (slot+1) & mask;
+            return slot;
+         }
+
+         bool contains( const uint64_t* table, uint64_t id )const
+         {
+            return table[ find( table, id ) ] == id;
+         }
+
+         void clear( uint32_t t )
+         {
+            memset( tables[t].data(), 0, tables[t].size()*sizeof(uint64_t) );
+         }
+
+         void rotate()
+         {
+            current ^= 1;
+            clear( current );
+            stats.forgotten += previous_used;
+            ++stats.rotations;
+            previous_used = used;
+            used          = 0;
+         }
+
+         mutable std::mutex     lock;
+         const uint64_t         mask;
+         const uint64_t         limit;
+         uint64_t               used;            ///< ids in the current table
+         uint64_t               previous_used;   ///< ids in the older table
+         uint32_t               current;
+         std::vector<uint64_t>  tables[2];
+         counters               stats;
+      };
+
+      std::vector< std::unique_ptr<stripe> > stripes;
+};
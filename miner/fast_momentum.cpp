@@ -11,6 +11,10 @@
 #include <algorithm>
 
 #include "hashtable.hpp"
+#include "birthday_buckets.hpp"
+#include "birthday_cache.hpp"
+#include "birthday_filter.hpp"
+#include "birthday_sort.hpp"
 #include "momentum.hpp"
 #include <fc/log/logger.hpp>
 #include <fc/thread/scoped_lock.hpp>
@@ -18,115 +22,808 @@
 #include <fc/thread/spin_lock.hpp>
 #include <openssl/sha.h>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include "sha2.h"
-extern "C" {
-#include "sphlib-3.0/c/sph_sha2.h"
-}
+#include "sha512_lanes.hpp"
 
 #include <iostream>
-	#define MAX_MOMENTUM_NONCE  (1<<26)
 	#define SEARCH_SPACE_BITS 50
-	#define BIRTHDAYS_PER_HASH 8
+
+   /** the repeat filter of the bloom engine holds few birthdays and is this much smaller */
+   #define BLOOM_REPEAT_RATIO 4
    
-   volatile bool cancel_search = false;
    uint64_t& get_thread_count()
    {
-      static uint64_t thread_count = boost::thread::hardware_concurrency();
+      static uint64_t thread_count = std::max( 1u, boost::thread::hardware_concurrency() );
       return thread_count;
    }
 
-   std::vector< std::pair<uint32_t,uint32_t> > search( uint32_t offset, hashtable& found, fc::sha256 head )
+   /**
+    *  Counters of one search thread.  Only that thread writes them, so a
+    *  relaxed load and store is enough and no update is ever a locked
+    *  instruction.  The padding keeps the counters of different threads off
+    *  each other's cache lines.
+    */
+   struct worker_counters
    {
-      std::vector<std::pair<uint32_t,uint32_t> > results;
-      results.reserve(16);
-      for( uint32_t i = offset*8; !cancel_search && i < MAX_MOMENTUM_NONCE;  )
-      {
-     //     fc::sha512::encoder enc;
-     //     enc.write( (char*)&i, sizeof(i) );
-     //     enc.write( (char*)&head, sizeof(head) );
-          sph_sha512_context context;
-          sph_sha512_init( &context );
-          sph_sha512(&context, (char*)&i, sizeof(i) );
-          sph_sha512(&context, (char*)&head, sizeof(head) );
-          fc::sha512 result;
-          sph_sha512_close( &context, (char*)&result );
-         /*
-         sha512_ctx ctx;
-         sha512_init( &ctx );
-          sha512_update(&ctx, (unsigned char*)&i, sizeof(i) );
-          sha512_update(&ctx, (unsigned char*)&head, sizeof(head) );
-          fc::sha512 result;
-          sha512_final(&ctx, (unsigned char*)&result );
+      worker_counters():hashes(0),stores(0),collisions(0){}
+
+      static void add( std::atomic<uint64_t>& counter, uint64_t n )
+      {
+         counter.store( counter.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+      }
+
+      char                  before[64];
+      std::atomic<uint64_t> hashes;
+      std::atomic<uint64_t> stores;
+      std::atomic<uint64_t> collisions;
+      char                  after[64];
+   };
+
+   /**
+    *  Search threads are created the first time they are needed and then
+    *  kept for the life of the process, there is no upper limit on
+    *  get_thread_count().
+    */
+   class search_pool
+   {
+      public:
+         /**
+          *  runs task( worker, counters ) for workers 0 to threads-1 on pool
+          *  threads first to first+threads-1 and waits for all of them
           */
-      
-     //     auto result = enc.result();
-        
-          for( uint32_t x = 0; x < 8; ++x )
+         template<typename Task>
+         void run( uint32_t first, uint32_t threads, Task task )
+         {
+            // other search groups grow the vectors concurrently, only the
+            // threads and counters they point to stay put
+            std::vector<fc::thread*>      thread( threads );
+            std::vector<worker_counters*> counter( threads );
+            {
+               std::lock_guard<std::mutex> lock( grow );
+               while( workers.size() < first + threads )
+               {
+                  workers.push_back( std::unique_ptr<fc::thread>( new fc::thread( "momentum" ) ) );
+                  counters.push_back( std::unique_ptr<worker_counters>( new worker_counters() ) );
+               }
+               for( uint32_t i = 0; i < threads; ++i )
+               {
+                  thread[i]  = workers[first + i].get();
+                  counter[i] = counters[first + i].get();
+               }
+            }
+
+            std::vector< fc::future<void> > done( threads );
+            for( uint32_t i = 0; i < threads; ++i )
+            {
+               worker_counters* c = counter[i];
+               done[i] = thread[i]->async( [&task,i,c](){ task( i, *c ); } );
+            }
+            for( uint32_t i = 0; i < threads; ++i )
+               done[i].wait();
+         }
+
+         std::vector<momentum_thread_counters> snapshot()const
+         {
+            std::lock_guard<std::mutex> lock( grow );
+            std::vector<momentum_thread_counters> result( counters.size() );
+            for( uint32_t i = 0; i < counters.size(); ++i )
+            {
+               result[i].hashes     = counters[i]->hashes.load( std::memory_order_relaxed );
+               result[i].stores     = counters[i]->stores.load( std::memory_order_relaxed );
+               result[i].collisions = counters[i]->collisions.load( std::memory_order_relaxed );
+            }
+            return result;
+         }
+
+      private:
+         std::vector< std::unique_ptr<fc::thread> >      workers;
+         std::vector< std::unique_ptr<worker_counters> > counters;
+         mutable std::mutex                              grow;
+   };
+
+   search_pool& get_search_pool()
+   {
+      static search_pool pool;
+      return pool;
+   }
+
+   uint32_t& get_search_groups()
+   {
+      static uint32_t groups = 1;
+      return groups;
+   }
+
+   /** pool threads of the search group instance belongs to, split as evenly as possible */
+   void search_group( int instance, uint32_t& first, uint32_t& threads )
+   {
+      const uint32_t total  = uint32_t( get_thread_count() );
+      const uint32_t groups = std::max<uint32_t>( 1, std::min<uint32_t>( get_search_groups(), total ) );
+      const uint32_t group  = uint32_t(instance) % groups;
+      first   = uint32_t( uint64_t(total) * group / groups );
+      threads = uint32_t( uint64_t(total) * (group+1) / groups ) - first;
+   }
+
+   uint32_t search_group_threads( int instance )
+   {
+      uint32_t first, threads;
+      search_group( instance, first, threads );
+      return threads;
+   }
+
+   uint64_t momentum_search_bytes( momentum_engine engine, uint32_t threads )
+   {
+      switch( engine )
+      {
+         case BUCKET_ENGINE: return birthday_buckets::bytes_for( std::max<uint32_t>( threads, 1 ) );
+         case CUCKOO_ENGINE: return cuckoo_hashtable::bytes_for( get_cuckoo_table_bytes() );
+         case BLOOM_ENGINE:
+         {
+            const uint64_t seen = birthday_filter::bytes_for( get_bloom_filter_bytes() );
+            return seen + birthday_filter::bytes_for( seen / BLOOM_REPEAT_RATIO );
+         }
+         case SORT_ENGINE:   return birthday_sort::bytes_for();
+         case TABLE_ENGINE:  break;
+      }
+      return uint64_t(TABLE_SIZE)*sizeof(uint64_t);
+   }
+
+   /**
+    *  Hands out [0,end) in fixed size chunks to whichever worker asks next,
+    *  so a core that is slower or preempted simply takes fewer chunks.
+    */
+   class work_cursor
+   {
+      public:
+         work_cursor( uint32_t end, uint32_t chunk ):next(0),end(end),chunk(chunk){}
+
+         bool take( uint32_t& first, uint32_t& last )
+         {
+            first = next.fetch_add( chunk, std::memory_order_relaxed );
+            if( first >= end ) return false;
+            last = std::min( first + chunk, end );
+            return true;
+         }
+
+      private:
+         std::atomic<uint32_t> next;
+         const uint32_t        end;
+         const uint32_t        chunk;
+   };
+
+   /** nonces per chunk, a multiple of BIRTHDAYS_PER_HASH*MAX_HASH_LANES */
+   #define NONCE_CHUNK (1<<16)
+
+   /**
+    *  Hashes the nonces [first,last) and passes every non zero birthday to
+    *  store( birthday, nonce ), counting both in counters.
+    *
+    *  @return false if the search was canceled
+    */
+   template<typename Store>
+   bool generate_birthdays( uint32_t first, uint32_t last, const birthday_midstate& midstate,
+                            const momentum_cancel& cancel, worker_counters& counters, Store store )
+   {
+      // lanes consecutive groups of BIRTHDAYS_PER_HASH nonces per call
+      const birthday_hasher& hasher = *get_birthday_hasher();
+      const uint32_t lanes  = hasher.lanes;
+      const uint32_t stride = BIRTHDAYS_PER_HASH*lanes;
+      uint32_t nonces[MAX_HASH_LANES];
+      uint64_t digests[MAX_HASH_LANES*8];
+      uint64_t hashes = 0;
+      uint64_t stores = 0;
+
+      bool complete = true;
+      for( uint32_t i = first; i < last; i += stride )
+      {
+          if( cancel.canceled() )
+          {
+             complete = false;
+             break;
+          }
+          for( uint32_t l = 0; l < lanes; ++l )
+             nonces[l] = i + l*BIRTHDAYS_PER_HASH;
+          hasher.hash( midstate, nonces, digests );
+          hashes += lanes;
+
+          for( uint32_t l = 0; l < lanes; ++l )
           {
-              uint64_t birthday = result._hash[x] >> 14;
-              if( birthday != 0 )
-              {
-                 uint32_t nonce = i+x;
-                 uint32_t cur = found.store( birthday, nonce );
-                 if( cur != uint32_t(-1) )
+             const uint64_t* result = digests + l*8;
+             for( uint32_t x = 0; x < 8; ++x )
+             {
+                 uint64_t birthday = result[x] >> 14;
+                 if( birthday != 0 )
                  {
-                     results.push_back( std::make_pair( cur, nonce ) );
-                     results.push_back( std::make_pair( nonce, cur ) );
+                    store( birthday, nonces[l]+x );
+                    ++stores;
                  }
-              }
+             }
           }
-          i += 8*get_thread_count();
       }
-      return results;
+      worker_counters::add( counters.hashes, hashes );
+      worker_counters::add( counters.stores, stores );
+      return complete;
+   }
+
+   typedef std::vector< std::pair<uint32_t,uint32_t> > pair_list;
+
+   /**
+    *  Decides when an AUTO_DEPTH search should stop.
+    *
+    *  A birthday stored after n others collides with a chance proportional
+    *  to the entries the table still holds, n less evictions, so pair yield
+    *  is estimated from counts instead of the few pairs actually found.  The
+    *  search stops once the expected pair rate of further chunks falls below
+    *  the average rate of the search so far, fixed per search cost included.
+    *  With few evictions that never happens and the whole space is searched.
+    */
+   template<typename Table>
+   class depth_governor
+   {
+      public:
+         enum { MIN_NONCES = MAX_MOMENTUM_NONCE / 4 };
+
+         depth_governor( bool enabled, const Table& table, int64_t overhead_us ) :
+            enabled(enabled),table(table),overhead_us(overhead_us),done(0),yield(0),
+            stopped(false),start(fc::time_point::now()){}
+
+         /** called by a worker after each chunk of nonces */
+         void chunk_done( uint32_t nonces )
+         {
+            if( !enabled ) return;
+            const uint64_t n        = done.fetch_add( nonces ) + nonces;
+            const uint64_t retained = n - std::min<uint64_t>( n, table.evictions() );
+            // expected pairs so far in units of 2^-50 * 2^16
+            const uint64_t y        = yield.fetch_add( (retained >> 8) * (nonces >> 8) ) + (retained >> 8) * (nonces >> 8);
+            if( n < MIN_NONCES ) return;
+
+            const double elapsed  = double( (fc::time_point::now() - start).count() ) + 1;
+            const double marginal = double(retained) * n / elapsed;
+            const double average  = double(y) * 65536 / (elapsed + overhead_us);
+            if( marginal < average )
+               stopped.store( true, std::memory_order_relaxed );
+         }
+
+         bool stop()const { return stopped.load( std::memory_order_relaxed ); }
+
+         uint32_t nonces()const { return uint32_t( std::min<uint64_t>( done.load(), MAX_MOMENTUM_NONCE ) ); }
+
+      private:
+         const bool                  enabled;
+         const Table&          table;
+         const int64_t         overhead_us;
+         std::atomic<uint64_t> done;
+         std::atomic<uint64_t> yield;
+         std::atomic<bool>     stopped;
+         const fc::time_point  start;
+   };
+
+   /** nonces a search may cover under the current depth setting */
+   uint32_t search_limit( const momentum_depth& depth )
+   {
+      if( depth.mode != FIXED_DEPTH ) return MAX_MOMENTUM_NONCE;
+      const uint32_t n = std::min<uint32_t>( depth.nonces, MAX_MOMENTUM_NONCE );
+      return std::max<uint32_t>( n - n % NONCE_CHUNK, NONCE_CHUNK );
+   }
+
+   /**
+    *  Time spent outside generating birthdays per search: the reset plus the
+    *  gap since the previous search on the instance ended.  Gaps over a
+    *  second are waits for new work rather than per search cost.
+    */
+   int64_t search_overhead_us( const momentum_search_stats& stats, const fc::time_point& start )
+   {
+      const int64_t gap = (start - stats.end).count();
+      return stats.reset_us + (gap >= 0 && gap < 1000000 ? gap : 0);
    }
-    
-   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head, int instance  )
+
+   pair_list merge_results( std::vector<pair_list>& per_worker )
    {
-      static hashtable found[1];
-      found[instance].reset();
-      std::vector< std::pair<uint32_t,uint32_t> > results;
+      pair_list results;
       results.reserve(16);
-      fc::spin_lock m;
+      for( uint32_t t = 0; t < per_worker.size(); ++t )
+         results.insert( results.end(), per_worker[t].begin(), per_worker[t].end() );
+      return results;
+   }
 
-      static fc::thread       mothreads[32];
-      fc::future<std::vector<std::pair<uint32_t,uint32_t>> > done[32];
-      
-      for( uint32_t i = 0; i < get_thread_count(); ++i )
+   /** searches with any table that has store( birthday, nonce ) and evictions() */
+   template<typename Table>
+   pair_list table_search( const birthday_midstate& midstate, int instance, const momentum_cancel& cancel, Table& table )
+   {
+      momentum_search_stats& stats = get_momentum_search_stats( instance );
+      auto start = fc::time_point::now();
+      table.reset();
+      auto generate = fc::time_point::now();
+      stats.reset_us = (generate - start).count();
+
+      uint32_t first_thread, threads;
+      search_group( instance, first_thread, threads );
+      const momentum_depth   depth   = get_momentum_depth();
+      std::vector<pair_list> results( threads );
+      work_cursor            cursor( search_limit( depth ), NONCE_CHUNK );
+      depth_governor<Table>  governor( depth.mode == AUTO_DEPTH, table, search_overhead_us( stats, start ) );
+
+      get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& counters )
       {
-         done[i]=mothreads[i].async( [&,i](){ return search( i, found[instance], head ); });
+         pair_list& mine = results[worker];
+         uint32_t first, last;
+         while( !governor.stop() && cursor.take( first, last ) )
+         {
+            const size_t found = mine.size();
+            bool complete = generate_birthdays( first, last, midstate, cancel, counters, [&]( uint64_t birthday, uint32_t nonce )
+            {
+                uint32_t cur = table.store( birthday, nonce );
+                if( cur != uint32_t(-1) )
+                {
+                    mine.push_back( std::make_pair( cur, nonce ) );
+                    mine.push_back( std::make_pair( nonce, cur ) );
+                }
+            });
+            worker_counters::add( counters.collisions, (mine.size() - found) / 2 );
+            if( !complete ) return;
+            governor.chunk_done( last - first );
+         }
+      });
+      stats.end         = fc::time_point::now();
+      stats.generate_us = (stats.end - generate).count();
+      stats.resolve_us  = 0;
+      stats.nonces      = depth.mode == AUTO_DEPTH ? governor.nonces() : search_limit( depth );
+      return merge_results( results );
+   }
+
+   pair_list table_search( const birthday_midstate& midstate, int instance, const momentum_cancel& cancel )
+   {
+      static std::unique_ptr<concurrent_hashtable> found[MAX_SEARCH_INSTANCES];
+      if( !found[instance] ) found[instance].reset( new concurrent_hashtable() );
+      return table_search( midstate, instance, cancel, *found[instance] );
+   }
+
+   uint64_t& get_cuckoo_table_bytes()
+   {
+      static uint64_t bytes = uint64_t(512) << 20;
+      return bytes;
+   }
+
+   /** the table is rebuilt if get_cuckoo_table_bytes() changed since the last search */
+   pair_list cuckoo_search( const birthday_midstate& midstate, int instance, const momentum_cancel& cancel )
+   {
+      static std::unique_ptr<cuckoo_hashtable> found[MAX_SEARCH_INSTANCES];
+      const uint64_t bytes = cuckoo_hashtable::bytes_for( get_cuckoo_table_bytes() );
+      if( !found[instance] || found[instance]->size() != bytes )
+      {
+         found[instance].reset();
+         found[instance].reset( new cuckoo_hashtable( bytes ) );
       }
-      
-      for( uint32_t t = 0; t < get_thread_count(); ++t )
+      return table_search( midstate, instance, cancel, *found[instance] );
+   }
+
+   pair_list bucket_search( const birthday_midstate& midstate, int instance, const momentum_cancel& cancel )
+   {
+      static birthday_buckets buckets[MAX_SEARCH_INSTANCES];
+      birthday_buckets& b = buckets[instance];
+      uint32_t first_thread, threads;
+      search_group( instance, first_thread, threads );
+      momentum_search_stats& stats = get_momentum_search_stats( instance );
+      auto start = fc::time_point::now();
+      b.reset( threads );
+      auto generate = fc::time_point::now();
+      stats.reset_us = (generate - start).count();
+
+      // scatter regions are sized for an even share per worker, so phase 1
+      // splits the nonce space up front instead of using a work_cursor.
+      // Buckets never evict, so AUTO_DEPTH always searches the full space.
+      const uint32_t limit = search_limit( get_momentum_depth() );
+      const uint32_t group = BIRTHDAYS_PER_HASH*MAX_HASH_LANES;
+      const uint32_t share = (limit/group + threads - 1) / threads * group;
+      get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& counters )
       {
-          auto r = done[t].wait();
-          results.insert( results.end(), r.begin(), r.end() );
+         const uint32_t first = std::min<uint32_t>( worker*share, limit );
+         const uint32_t last  = std::min<uint32_t>( first + share, limit );
+         generate_birthdays( first, last, midstate, cancel, counters,
+                             [&]( uint64_t birthday, uint32_t nonce ){ b.scatter( worker, birthday, nonce ); } );
+      });
+      auto resolve = fc::time_point::now();
+      stats.generate_us = (resolve - generate).count();
+      stats.resolve_us  = 0;
+      if( cancel.canceled() ) return pair_list();
+
+      std::vector<pair_list> results( threads );
+      work_cursor            cursor( birthday_buckets::BUCKET_COUNT, 1 );
+      get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& counters )
+      {
+         std::vector<uint64_t> scratch;
+         uint32_t first, last;
+         while( !cancel.canceled() && cursor.take( first, last ) )
+            b.resolve( first, scratch, results[worker] );
+         worker_counters::add( counters.collisions, results[worker].size() / 2 );
+      });
+      stats.end        = fc::time_point::now();
+      stats.resolve_us = (stats.end - resolve).count();
+      stats.nonces     = limit;
+      return merge_results( results );
+   }
+
+   std::vector<momentum_thread_counters> get_momentum_counters()
+   {
+      return get_search_pool().snapshot();
+   }
+
+   uint64_t& get_bloom_filter_bytes()
+   {
+      static uint64_t bytes = uint64_t(32) << 20;
+      return bytes;
+   }
+
+   /** a birthday and the nonce it came from, sorted by birthday to find repeats */
+   typedef std::vector< std::pair<uint64_t,uint32_t> > candidate_list;
+
+   /**
+    *  Pass one inserts every birthday into the seen filter and those it
+    *  already held into the repeat filter.  Pass two hashes the nonces again
+    *  and keeps only birthdays the repeat filter holds, which are the real
+    *  collisions plus the false positives of the seen filter.  Sorting those
+    *  few finds the pairs exactly.  Filter inserts write a word that is
+    *  usually in cache instead of a table line that never is, at the cost of
+    *  hashing everything twice.
+    */
+   pair_list bloom_search( const birthday_midstate& midstate, int instance, const momentum_cancel& cancel )
+   {
+      static std::unique_ptr<birthday_filter> seen[MAX_SEARCH_INSTANCES];
+      static std::unique_ptr<birthday_filter> repeat[MAX_SEARCH_INSTANCES];
+      uint32_t first_thread, threads;
+      search_group( instance, first_thread, threads );
+      momentum_search_stats& stats = get_momentum_search_stats( instance );
+      auto start = fc::time_point::now();
+
+      const uint64_t bytes = birthday_filter::bytes_for( get_bloom_filter_bytes() );
+      if( !seen[instance] || seen[instance]->size() != bytes )
+      {
+         seen[instance].reset();
+         repeat[instance].reset();
+         seen[instance].reset( new birthday_filter( bytes, 0 ) );
+         repeat[instance].reset( new birthday_filter( bytes / BLOOM_REPEAT_RATIO, 0x5bd1e9955bd1e995ull ) );
+      }
+      birthday_filter& once  = *seen[instance];
+      birthday_filter& twice = *repeat[instance];
+      once.clear();
+      twice.clear();
+      auto generate = fc::time_point::now();
+      stats.reset_us = (generate - start).count();
+
+      // the filters never evict, so AUTO_DEPTH always searches the full space
+      const uint32_t limit = search_limit( get_momentum_depth() );
+      {
+         work_cursor cursor( limit, NONCE_CHUNK );
+         get_search_pool().run( first_thread, threads, [&]( uint32_t, worker_counters& counters )
+         {
+            uint32_t first, last;
+            while( cursor.take( first, last ) )
+            {
+               if( !generate_birthdays( first, last, midstate, cancel, counters, [&]( uint64_t birthday, uint32_t )
+                   {
+                      if( once.insert( birthday ) ) twice.insert( birthday );
+                   }) ) return;
+            }
+         });
+      }
+      if( cancel.canceled() ) return pair_list();
+
+      std::vector<candidate_list> candidates( threads );
+      {
+         work_cursor cursor( limit, NONCE_CHUNK );
+         get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& counters )
+         {
+            candidate_list& mine = candidates[worker];
+            uint32_t first, last;
+            while( cursor.take( first, last ) )
+            {
+               if( !generate_birthdays( first, last, midstate, cancel, counters, [&]( uint64_t birthday, uint32_t nonce )
+                   {
+                      if( twice.contains( birthday ) ) mine.push_back( std::make_pair( birthday, nonce ) );
+                   }) ) return;
+            }
+         });
+      }
+      auto resolve = fc::time_point::now();
+      stats.generate_us = (resolve - generate).count();
+      stats.resolve_us  = 0;
+      if( cancel.canceled() ) return pair_list();
+
+      // like the other engines the first nonce of a birthday pairs with each later one
+      std::vector<pair_list> results( 1 );
+      get_search_pool().run( first_thread, 1, [&]( uint32_t, worker_counters& counters )
+      {
+         candidate_list all;
+         for( uint32_t t = 0; t < threads; ++t )
+         {
+            all.insert( all.end(), candidates[t].begin(), candidates[t].end() );
+            candidate_list().swap( candidates[t] );
+         }
+         std::sort( all.begin(), all.end() );
+         for( size_t i = 0; i < all.size(); )
+         {
+            size_t j = i + 1;
+            for( ; j < all.size() && all[j].first == all[i].first; ++j )
+            {
+               results[0].push_back( std::make_pair( all[i].second, all[j].second ) );
+               results[0].push_back( std::make_pair( all[j].second, all[i].second ) );
+            }
+            i = j;
+         }
+         worker_counters::add( counters.collisions, results[0].size() / 2 );
+      });
+      stats.end        = fc::time_point::now();
+      stats.resolve_us = (stats.end - resolve).count();
+      stats.nonces     = limit;
+      return merge_results( results );
+   }
+
+   uint64_t getBirthdayHash( const birthday_midstate& midstate, uint32_t a );
+
+   /**
+    *  Stores every birthday in a flat array, radix sorts it and scans for
+    *  equal neighbours.  Nothing is ever evicted so every collision is found,
+    *  and all memory access after the store is sequential.
+    */
+   pair_list sort_search( const birthday_midstate& midstate, int instance, const momentum_cancel& cancel )
+   {
+      static birthday_sort sorts[MAX_SEARCH_INSTANCES];
+      birthday_sort& sorter = sorts[instance];
+      uint32_t first_thread, threads;
+      search_group( instance, first_thread, threads );
+      momentum_search_stats& stats = get_momentum_search_stats( instance );
+      auto start = fc::time_point::now();
+
+      // like the bucket engine every worker fills its own region, so the
+      // nonce space is split up front and AUTO_DEPTH searches all of it
+      const uint32_t limit = search_limit( get_momentum_depth() );
+      const uint32_t group = BIRTHDAYS_PER_HASH*MAX_HASH_LANES;
+      const uint32_t share = (limit/group + threads - 1) / threads * group;
+      sorter.reset( threads, share );
+      auto generate = fc::time_point::now();
+      stats.reset_us = (generate - start).count();
+
+      get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& counters )
+      {
+         const uint32_t first = std::min<uint32_t>( worker*share, limit );
+         const uint32_t last  = std::min<uint32_t>( first + share, limit );
+         generate_birthdays( first, last, midstate, cancel, counters,
+                             [&]( uint64_t birthday, uint32_t nonce ){ sorter.store( worker, birthday, nonce ); } );
+      });
+      auto resolve = fc::time_point::now();
+      stats.generate_us = (resolve - generate).count();
+      stats.resolve_us  = 0;
+
+      for( uint32_t pass = 0; pass < birthday_sort::PASSES; ++pass )
+      {
+         if( cancel.canceled() ) return pair_list();
+         get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& )
+         {
+            sorter.count( pass, worker, cancel );
+         });
+         // counts of an interrupted pass would send the scatter out of bounds
+         if( cancel.canceled() ) return pair_list();
+         sorter.prefix();
+         get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& )
+         {
+            sorter.scatter( pass, worker, cancel );
+         });
+         sorter.flip();
+      }
+      if( cancel.canceled() ) return pair_list();
+
+      // equal keys are the top bits of the birthday, confirm with all of it
+      std::vector<pair_list> results( threads );
+      get_search_pool().run( first_thread, threads, [&]( uint32_t worker, worker_counters& counters )
+      {
+         pair_list& mine = results[worker];
+         sorter.scan( worker, cancel, [&]( uint32_t a, uint32_t b )
+         {
+            if( getBirthdayHash( midstate, a ) == getBirthdayHash( midstate, b ) )
+            {
+               mine.push_back( std::make_pair( a, b ) );
+               mine.push_back( std::make_pair( b, a ) );
+            }
+         });
+         worker_counters::add( counters.collisions, mine.size() / 2 );
+      });
+      stats.end        = fc::time_point::now();
+      stats.resolve_us = (stats.end - resolve).count();
+      stats.nonces     = limit;
+      return merge_results( results );
+   }
+
+   momentum_depth& get_momentum_depth()
+   {
+      static momentum_depth depth;
+      return depth;
+   }
+
+   bool parse_momentum_depth( const std::string& name, momentum_depth& depth )
+   {
+      if( name == "full" )
+      {
+         depth.mode = FULL_DEPTH;
+         return true;
+      }
+      if( name == "auto" )
+      {
+         depth.mode = AUTO_DEPTH;
+         return true;
+      }
+      if( name.empty() || name.size() > 9 || name.find_first_not_of( "0123456789" ) != std::string::npos )
+         return false;
+      const uint64_t nonces = strtoull( name.c_str(), nullptr, 10 );
+      if( nonces == 0 || nonces > MAX_MOMENTUM_NONCE ) return false;
+      depth.mode   = FIXED_DEPTH;
+      depth.nonces = uint32_t(nonces);
+      return true;
+   }
+
+   momentum_search_stats& get_momentum_search_stats( int instance )
+   {
+      static momentum_search_stats stats[MAX_SEARCH_INSTANCES];
+      return stats[instance];
+   }
+
+   pair_list momentum_search( pow_seed_type head, int instance, momentum_engine engine, const momentum_cancel& cancel )
+   {
+      const birthday_midstate midstate( (const char*)&head );
+      switch( engine )
+      {
+         case BUCKET_ENGINE:
+            return bucket_search( midstate, instance, cancel );
+         case CUCKOO_ENGINE:
+            return cuckoo_search( midstate, instance, cancel );
+         case BLOOM_ENGINE:
+            return bloom_search( midstate, instance, cancel );
+         case SORT_ENGINE:
+            return sort_search( midstate, instance, cancel );
+         case TABLE_ENGINE:
+         default:
+            return table_search( midstate, instance, cancel );
       }
-      
-      return results;
    }
 
-	uint64_t getBirthdayHash(pow_seed_type midHash, uint32_t a)
-  {
+   pair_list momentum_search( pow_seed_type head, int instance, momentum_engine engine )
+   {
+      static const momentum_cancel never;
+      return momentum_search( head, instance, engine, never );
+   }
+
+   const char* momentum_engine_name( momentum_engine engine )
+   {
+      switch( engine )
+      {
+         case BUCKET_ENGINE: return "bucket";
+         case TABLE_ENGINE:  return "table";
+         case CUCKOO_ENGINE: return "cuckoo";
+         case BLOOM_ENGINE:  return "bloom";
+         case SORT_ENGINE:   return "sort";
+      }
+      return "unknown";
+   }
+
+   bool parse_momentum_engine( const std::string& name, momentum_engine& engine )
+   {
+      for( int e = TABLE_ENGINE; e <= SORT_ENGINE; ++e )
+      {
+         if( name == momentum_engine_name( momentum_engine(e) ) )
+         {
+            engine = momentum_engine(e);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   uint64_t getBirthdayHash( const birthday_midstate& midstate, uint32_t a )
+   {
       uint32_t index = a - a%BIRTHDAYS_PER_HASH;
-      char  hash_tmp[sizeof(midHash)+4];
-      memcpy( (char*)&hash_tmp[4], (char*)&midHash, sizeof(midHash) );
-      memcpy( (char*)&hash_tmp[0], (char*)&index, sizeof(index) );
-      
-      uint64_t  result_hash[8];
-		  SHA512((unsigned char*)hash_tmp, sizeof(hash_tmp), (unsigned char*)&result_hash);
-      
+      uint64_t result_hash[8];
+      birthday_hash( midstate, index, result_hash );
       return result_hash[a%BIRTHDAYS_PER_HASH]>>(64-SEARCH_SPACE_BITS);
-	}
+   }
 
-   bool momentum_verify( pow_seed_type head, uint32_t a, uint32_t b )
+   uint64_t getBirthdayHash( pow_seed_type midHash, uint32_t a )
+   {
+      return getBirthdayHash( birthday_midstate( (const char*)&midHash ), a );
+   }
+
+   bool nonces_in_range( uint32_t a, uint32_t b )
    {
       if( a == b ) return false;
       if( a == 0 ) return false;
       if( b == 0 ) return false;
       if( a > MAX_MOMENTUM_NONCE ) return false;
       if( b > MAX_MOMENTUM_NONCE ) return false;
+      return true;
+   }
+
+   bool momentum_verify( pow_seed_type head, uint32_t a, uint32_t b )
+   {
+      if( !nonces_in_range( a, b ) ) return false;
 
-      auto r = (getBirthdayHash(head,a) == getBirthdayHash(head,b));
+      const birthday_midstate midstate( (const char*)&head );
+      const uint32_t group_a = a - a%BIRTHDAYS_PER_HASH;
+      const uint32_t group_b = b - b%BIRTHDAYS_PER_HASH;
+      if( group_a == group_b )
+      {
+         // both birthdays come from the same digest
+         uint64_t result_hash[8];
+         birthday_hash( midstate, group_a, result_hash );
+         return (result_hash[a%BIRTHDAYS_PER_HASH]>>(64-SEARCH_SPACE_BITS)) ==
+                (result_hash[b%BIRTHDAYS_PER_HASH]>>(64-SEARCH_SPACE_BITS));
+      }
+      auto r = (getBirthdayHash(midstate,a) == getBirthdayHash(midstate,b));
       return r;
    }
 
+   std::atomic<uint32_t>& verify_generation()
+   {
+      static std::atomic<uint32_t> generation(0);
+      return generation;
+   }
+
+   void momentum_verify_new_work()
+   {
+      ++verify_generation();
+   }
+
+   /** each verify thread keeps its own cache */
+   birthday_cache& get_birthday_cache()
+   {
+      static boost::thread_specific_ptr<birthday_cache> cache;
+      if( !cache.get() ) cache.reset( new birthday_cache() );
+      cache->sync( verify_generation().load() );
+      return *cache;
+   }
+
+   void momentum_verify_batch( const momentum_share* shares, uint32_t count, bool* valid )
+   {
+      const birthday_hasher& hasher = *get_birthday_hasher();
+      birthday_cache&        cache  = get_birthday_cache();
+      uint32_t nonces[MAX_HASH_LANES];
+      uint64_t digests[MAX_HASH_LANES*8];
+
+      for( uint32_t i = 0; i < count; ++i )
+      {
+         const momentum_share& share = shares[i];
+         const char*           head  = (const char*)&share.head;
+         valid[i] = false;
+         if( !nonces_in_range( share.a, share.b ) ) continue;
+
+         const uint32_t group_a  = share.a - share.a%BIRTHDAYS_PER_HASH;
+         const uint32_t group_b  = share.b - share.b%BIRTHDAYS_PER_HASH;
+         uint64_t*      digest_a = digests;
+         uint64_t*      digest_b = group_a == group_b ? digests : digests + 8;
+         bool           have_a   = cache.find( head, group_a, digest_a );
+         bool           have_b   = group_a == group_b ? have_a : cache.find( head, group_b, digest_b );
+
+         if( !have_a || !have_b )
+         {
+            const birthday_midstate midstate( head );
+            if( !have_a && !have_b && group_a != group_b && hasher.lanes >= 2 )
+            {
+               // both groups in one multi lane call, spare lanes repeat group_b
+               nonces[0] = group_a;
+               for( uint32_t l = 1; l < hasher.lanes; ++l )
+                  nonces[l] = group_b;
+               hasher.hash( midstate, nonces, digests );
+            }
+            else
+            {
+               if( !have_a ) birthday_hash( midstate, group_a, digest_a );
+               if( !have_b && group_a != group_b ) birthday_hash( midstate, group_b, digest_b );
+            }
+            if( !have_a ) cache.insert( head, group_a, digest_a );
+            if( !have_b && group_a != group_b ) cache.insert( head, group_b, digest_b );
+         }
+
+         valid[i] = (digest_a[share.a%BIRTHDAYS_PER_HASH] >> (64-SEARCH_SPACE_BITS)) ==
+                    (digest_b[share.b%BIRTHDAYS_PER_HASH] >> (64-SEARCH_SPACE_BITS));
+      }
+   }
@@ -3,98 +3,385 @@
 #include <vector>
 #include <array>
 #include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include "table_memory.hpp"
 
-
-#if 1
 const int TABLE_SIZE =  ((1<<26)*1.5);
 
+/**
+ *  A slot packs the nonce, the part of the birthday not implied by the slot
+ *  index and a tag into a single word, 0 marks an empty slot.
+ *
+ *  [ tag : 10 | birthday / table size : 28 | nonce : 26 ]
+ *
+ *  The tag is the epoch of the search that wrote the slot, so a new search
+ *  only has to bump the epoch and every older slot reads as empty.
+ */
+struct packed_slot
+{
+   enum
+   {
+      NONCE_BITS    = 26,
+      QUOTIENT_BITS = 28,
+      TAG_SHIFT     = NONCE_BITS + QUOTIENT_BITS,
+      TAG_BITS      = 64 - TAG_SHIFT
+   };
+
+   static uint64_t pack( uint64_t quotient, uint32_t nonce, uint64_t tag )
+   {
+      return (tag << TAG_SHIFT) | (quotient << NONCE_BITS) | nonce;
+   }
+   static uint32_t nonce( uint64_t slot )    { return uint32_t( slot & ((1ull<<NONCE_BITS)-1) ); }
+   static uint64_t quotient( uint64_t slot ) { return (slot >> NONCE_BITS) & ((1ull<<QUOTIENT_BITS)-1); }
+   static uint64_t tag( uint64_t slot )      { return slot >> TAG_SHIFT; }
+};
+
+/**
+ *  Search generation shared by the tables.  Epochs run from 1 to
+ *  MAX_EPOCH, when they wrap the table is cleared once so no slot left
+ *  from MAX_EPOCH searches ago can be mistaken for a current one.
+ */
+class table_epoch
+{
+   public:
+      enum { MAX_EPOCH = (1 << packed_slot::TAG_BITS) - 1 };
+
+      /** @param limit the largest epoch the slot tag can hold */
+      table_epoch( uint64_t limit = MAX_EPOCH ):current(0),limit(limit){}
+
+      /** @return true if the caller must clear the whole table */
+      bool advance()
+      {
+         if( current == limit || current == 0 )
+         {
+            current = 1;
+            return true;
+         }
+         ++current;
+         return false;
+      }
+
+      uint64_t get()const { return current; }
+
+   private:
+      uint64_t current;
+      uint64_t limit;
+};
+
+static_assert( (1ull<<50) / TABLE_SIZE < (1ull<<packed_slot::QUOTIENT_BITS), "birthday quotient must fit a packed slot" );
+
 class hashtable
 {
    public:
       hashtable() :
-         itable(new std::array< std::pair<uint64_t,uint32_t>,TABLE_SIZE >),
-         table(*itable)
+         memory( TABLE_SIZE*sizeof(uint64_t) ),
+         table( (uint64_t*)memory.data() )
       {
          reset();
       }
+
+      /** starts a new search, only clears memory when the epoch wraps */
       void reset()
       {
-         memset( (char*)table.data(), 0, table.size()*sizeof(std::pair<uint64_t,uint32_t>) );
+         if( epoch.advance() )
+            memset( (char*)table, 0, TABLE_SIZE*sizeof(uint64_t) );
       }
 
       uint32_t store( uint64_t key, uint32_t val )
       {
-         uint64_t next_key = key;
-         auto index = next_key % table.size() ;
+         auto index    = key % TABLE_SIZE;
+         auto quotient = key / TABLE_SIZE;
+         uint64_t slot = table[index];
             //if matching collision in table, return it
-            if( table[index].first == key  )
+            if( packed_slot::tag(slot) == epoch.get() && packed_slot::quotient(slot) == quotient )
             {
-               return table[index].second;
+               return packed_slot::nonce(slot);
             }
 
          //no collision, add to table
-         table[index].first   = key;
-         table[index].second  = val;
+         table[index] = packed_slot::pack( quotient, val, epoch.get() );
          return -1;
       }
 
    private:
-      std::array< std::pair<uint64_t,uint32_t>,TABLE_SIZE >*  itable;
-      std::array<  std::pair<uint64_t,uint32_t>,TABLE_SIZE >&  table;
-};
+      hashtable( const hashtable& );
+      hashtable& operator=( const hashtable& );
 
-#else 
-//reduced memory block allocation size version for win32
-const size_t TABLE_SIZE = (1<<25);
+      table_memory memory;
+      uint64_t*    table;
+      table_epoch  epoch;
+};
 
-class hashtable
+/**
+ *  Lock free version of hashtable shared by all search threads.
+ *
+ *  Slots are grouped in buckets of one cache line.  A birthday may live in
+ *  any slot of its bucket and is claimed with a 64 bit compare and swap, so
+ *  two threads storing the same birthday always see each other and
+ *  neighbours are only overwritten once the whole bucket is full.
+ */
+class concurrent_hashtable
 {
    public:
-      hashtable() :
-         table( new std::pair<uint64_t,uint32_t>[TABLE_SIZE] ),
-         table2( new std::pair<uint64_t,uint32_t>[TABLE_SIZE] )
+      enum { BUCKET_SLOTS = 8 };
+
+      /** table_memory is page aligned so every bucket starts a cache line */
+      concurrent_hashtable( size_t slots = TABLE_SIZE ) :
+         buckets( slots / BUCKET_SLOTS ),
+         inverse( 1.0 / buckets ),
+         memory( buckets*BUCKET_SLOTS*sizeof(uint64_t) ),
+         table( (std::atomic<uint64_t>*)memory.data() ),
+         evicted(0)
       {
+         static_assert( sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "slots are cleared with memset" );
          reset();
       }
+
+      /**
+       *  Not thread safe, only call between searches.  Slots of older epochs
+       *  read as empty so memory is only cleared when the epoch wraps.
+       */
       void reset()
       {
-         memset( (char*)table, 0, TABLE_SIZE*sizeof(std::pair<uint64_t,uint32_t>) );
-         memset( (char*)table, 0, TABLE_SIZE*sizeof(std::pair<uint64_t,uint32_t>) );
+         if( epoch.advance() )
+            memset( (char*)table, 0, buckets*BUCKET_SLOTS*sizeof(uint64_t) );
+         evicted = 0;
       }
 
+      /** @pre key / (slots / BUCKET_SLOTS) fits packed_slot::QUOTIENT_BITS */
       uint32_t store( uint64_t key, uint32_t val )
       {
-         uint64_t next_key = key;
-         auto index = next_key % TABLE_SIZE ;
-         //if collision
-         if ( table[index].first != 0 )
+         uint64_t quotient, index;
+         divide( key, quotient, index );
+         const uint64_t         current  = epoch.get();
+         const uint64_t         desired  = packed_slot::pack( quotient, val, current );
+         std::atomic<uint64_t>* bucket   = table + index*BUCKET_SLOTS;
+
+         // buckets fill in slot order within an epoch, so the first stale or
+         // empty slot ends the entries of this search
+         for( uint32_t i = 0; i < BUCKET_SLOTS; ++i )
          {
-            //if matching collision in first table, return it
-            if( table[index].first == key  )
+            uint64_t slot = bucket[i].load( std::memory_order_relaxed );
+            if( packed_slot::tag(slot) != current )
             {
-               return table[index].second;
+               if( bucket[i].compare_exchange_strong( slot, desired, std::memory_order_relaxed ) )
+                  return -1;
+               // lost the race, slot now holds the winner which may be our birthday
             }
-            //if matching collision in second table, return it
-            else if( table2[index].first == key  )
+            if( packed_slot::quotient(slot) == quotient )
+               return packed_slot::nonce(slot);
+         }
+
+         // full bucket, give up one entry like the direct mapped table does
+         bucket[quotient % BUCKET_SLOTS].store( desired, std::memory_order_relaxed );
+         evicted.fetch_add( 1, std::memory_order_relaxed );
+         return -1;
+      }
+
+      /** entries overwritten because their bucket was full since the last reset */
+      uint64_t evictions()const { return evicted.load(); }
+
+   private:
+      concurrent_hashtable( const concurrent_hashtable& );
+      concurrent_hashtable& operator=( const concurrent_hashtable& );
+
+      /**
+       *  key / buckets and key % buckets without a 64 bit divide, keys have at
+       *  most 50 bits so the double estimate is off by no more than one
+       */
+      void divide( uint64_t key, uint64_t& quotient, uint64_t& remainder )const
+      {
+         quotient  = uint64_t( double(key) * inverse );
+         remainder = key - quotient*buckets;
+         if( int64_t(remainder) < 0 )          { --quotient; remainder += buckets; }
+         else if( remainder >= buckets )       { ++quotient; remainder -= buckets; }
+      }
+
+      uint64_t                buckets;
+      double                  inverse;
+      table_memory            memory;
+      std::atomic<uint64_t>*  table;
+      std::atomic<uint64_t>   evicted;
+      table_epoch             epoch;
+};
+
+static_assert( (1ull<<50) / (TABLE_SIZE/concurrent_hashtable::BUCKET_SLOTS) < (1ull<<packed_slot::QUOTIENT_BITS),
+               "birthday quotient must fit a packed slot" );
+
+/**
+ *  Low memory alternative to concurrent_hashtable for hosts that cannot
+ *  spare 768 MB per search, any power of two from 256 MB to 1 GB.
+ *
+ *  Every birthday has two candidate buckets of one cache line.  The second
+ *  is the first xor a hash of the quotient, so an entry can be moved to its
+ *  other bucket using only what its slot stores.  A store claims the first
+ *  empty slot of either bucket with a compare and swap, and when both are
+ *  full tries MAX_KICKS times to move a resident entry over to its other
+ *  bucket.  If that fails too the birthday is only looked up, so a full
+ *  table keeps what it has instead of evicting, and after one failure per
+ *  bucket on average kicks are no longer tried.
+ *
+ *  [ tag : 9 | in second bucket : 1 | birthday >> bucket bits : 28 | nonce : 26 ]
+ *
+ *  Slots are never emptied within an epoch, so a bucket with an empty slot
+ *  proves the birthday is not in its other bucket.  A thread scanning for
+ *  an entry that another thread is moving can miss it, which loses a pair
+ *  just like an eviction does.
+ */
+class cuckoo_hashtable
+{
+   public:
+      enum
+      {
+         BUCKET_SLOTS    = 8,
+         MAX_KICKS       = 4,
+         NONCE_BITS      = 26,
+         QUOTIENT_BITS   = 28,
+         SECOND_SHIFT    = NONCE_BITS + QUOTIENT_BITS,
+         TAG_SHIFT       = SECOND_SHIFT + 1,
+         TAG_BITS        = 64 - TAG_SHIFT,
+         MIN_BUCKET_BITS = 50 - QUOTIENT_BITS,
+         MAX_BUCKET_BITS = MIN_BUCKET_BITS + 2
+      };
+
+      /** @return bucket index bits of the largest table within bytes */
+      static uint32_t bucket_bits_for( uint64_t bytes )
+      {
+         uint32_t bits = MIN_BUCKET_BITS;
+         while( bits < MAX_BUCKET_BITS && (uint64_t(BUCKET_SLOTS*sizeof(uint64_t)) << (bits+1)) <= bytes )
+            ++bits;
+         return bits;
+      }
+
+      /** @return memory a table created with bytes actually uses */
+      static uint64_t bytes_for( uint64_t bytes )
+      {
+         return uint64_t(BUCKET_SLOTS*sizeof(uint64_t)) << bucket_bits_for( bytes );
+      }
+
+      cuckoo_hashtable( uint64_t bytes ) :
+         bits( bucket_bits_for( bytes ) ),
+         mask( (uint64_t(1) << bits) - 1 ),
+         memory( bytes_for( bytes ) ),
+         table( (std::atomic<uint64_t>*)memory.data() ),
+         dropped(0),
+         epoch( (1 << TAG_BITS) - 1 )
+      {
+         reset();
+      }
+
+      /** not thread safe, only call between searches */
+      void reset()
+      {
+         if( epoch.advance() )
+            memset( (char*)table, 0, (mask+1)*BUCKET_SLOTS*sizeof(uint64_t) );
+         dropped = 0;
+      }
+
+      uint32_t store( uint64_t key, uint32_t val )
+      {
+         const uint64_t quotient = key >> bits;
+         const uint64_t first    = key & mask;
+         const uint64_t second   = first ^ other( quotient );
+         const uint64_t current  = epoch.get();
+         uint32_t found;
+
+         if( claim( first, pack( quotient, 0, val, current ), found ) ) return found;
+         if( claim( second, pack( quotient, 1, val, current ), found ) ) return found;
+
+         // both full, make room in the first bucket by moving a resident out.
+         // Once stores start failing nearly every bucket is full and kicks
+         // would only cost cache misses.
+         std::atomic<uint64_t>* bucket = table + first*BUCKET_SLOTS;
+         const bool saturated = dropped.load( std::memory_order_relaxed ) > mask;
+         for( uint32_t k = 0; !saturated && k < MAX_KICKS; ++k )
+         {
+            std::atomic<uint64_t>& victim = bucket[(quotient + k) % BUCKET_SLOTS];
+            uint64_t resident = victim.load( std::memory_order_relaxed );
+            const uint64_t moved = resident ^ (uint64_t(1) << SECOND_SHIFT);
+            if( !claim_empty( first ^ other( quotient_of( resident ) ), moved ) ) continue;
+            if( victim.compare_exchange_strong( resident, pack( quotient, 0, val, current ), std::memory_order_relaxed ) )
+               return -1;
+            // someone else replaced the resident first, the copy is harmless
+         }
+         dropped.fetch_add( 1, std::memory_order_relaxed );
+         return -1;
+      }
+
+      /** birthdays that found both buckets full and were not stored since the last reset */
+      uint64_t evictions()const { return dropped.load(); }
+
+      uint64_t size()const { return (mask+1)*BUCKET_SLOTS*sizeof(uint64_t); }
+
+   private:
+      cuckoo_hashtable( const cuckoo_hashtable& );
+      cuckoo_hashtable& operator=( const cuckoo_hashtable& );
+
+      static uint64_t pack( uint64_t quotient, uint64_t second, uint32_t nonce, uint64_t tag )
+      {
+         return (tag << TAG_SHIFT) | (second << SECOND_SHIFT) | (quotient << NONCE_BITS) | nonce;
+      }
+      static uint64_t quotient_of( uint64_t slot ) { return (slot >> NONCE_BITS) & ((uint64_t(1)<<QUOTIENT_BITS)-1); }
+
+      /** xor distance between the two buckets of a quotient, never 0 */
+      uint64_t other( uint64_t quotient )const
+      {
+         return ((quotient * 0x9e3779b97f4a7c15ull) >> 32 | 1) & mask;
+      }
+
+      /**
+       *  Stores desired in the first empty slot of bucket unless an entry for
+       *  the same birthday is found first, in the same way as
+       *  concurrent_hashtable::store.
+       *
+       *  @return false if the bucket is full, otherwise true with found set
+       *          to the nonce of the earlier entry or -1
+       */
+      bool claim( uint64_t index, uint64_t desired, uint32_t& found )
+      {
+         const uint64_t         current = desired >> TAG_SHIFT;
+         const uint64_t         key     = desired >> NONCE_BITS;
+         std::atomic<uint64_t>* bucket  = table + index*BUCKET_SLOTS;
+         for( uint32_t i = 0; i < BUCKET_SLOTS; ++i )
+         {
+            uint64_t slot = bucket[i].load( std::memory_order_relaxed );
+            if( (slot >> TAG_SHIFT) != current )
             {
-               return table2[index].second;
+               if( bucket[i].compare_exchange_strong( slot, desired, std::memory_order_relaxed ) )
+               {
+                  found = -1;
+                  return true;
+               }
             }
-            //add to second table
-            else
+            if( (slot >> NONCE_BITS) == key )
             {
-               table2[index].first   = key;
-               table2[index].second  = val;
-               return -1;
+               found = uint32_t( slot & ((uint64_t(1)<<NONCE_BITS)-1) );
+               return true;
             }
          }
-         //no collision, add to first table
-         table[index].first   = key;
-         table[index].second  = val;
-         return -1;
+         return false;
       }
 
-   private:
-      std::pair<uint64_t,uint32_t>*  table;
-      std::pair<uint64_t,uint32_t>*  table2;
+      /** stores entry in the first empty slot of bucket, false if it is full */
+      bool claim_empty( uint64_t index, uint64_t entry )
+      {
+         const uint64_t         current = entry >> TAG_SHIFT;
+         std::atomic<uint64_t>* bucket  = table + index*BUCKET_SLOTS;
+         for( uint32_t i = 0; i < BUCKET_SLOTS; ++i )
+         {
+            uint64_t slot = bucket[i].load( std::memory_order_relaxed );
+            if( (slot >> TAG_SHIFT) != current &&
+                bucket[i].compare_exchange_strong( slot, entry, std::memory_order_relaxed ) )
+               return true;
+         }
+         return false;
+      }
+
+      const uint32_t          bits;
+      const uint64_t          mask;
+      table_memory            memory;
+      std::atomic<uint64_t>*  table;
+      std::atomic<uint64_t>   dropped;
+      table_epoch             epoch;
 };
-#endif
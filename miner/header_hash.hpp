@@ -0,0 +1,50 @@
+#pragma once
+#include <fc/crypto/sha256.hpp>
+#include "sha2.h"
+#include <string.h>
+#include <stdint.h>
+
+/**
+ *  Double SHA-256 of an 88 byte header for many birthday pairs.
+ *
+ *  The header ends with birthday_a and birthday_b, so its first 64 byte
+ *  block is the same for every pair of a search.  That block is compressed
+ *  once here, and each pair only costs the tail block and the outer hash,
+ *  two compressions instead of three.
+ */
+class pair_header_hasher
+{
+   public:
+      enum { HEADER_SIZE = 88, PREFIX_SIZE = 80 };
+
+      /** @param header the first PREFIX_SIZE bytes are used */
+      pair_header_hasher( const char* header )
+      {
+         sha256_init( &prefix );
+         sha256_update( &prefix, (const unsigned char*)header, SHA256_BLOCK_SIZE );
+         memcpy( tail, header + SHA256_BLOCK_SIZE, sizeof(tail) );
+      }
+
+      /** @return the same value as Hash( header with a and b, 88 ) */
+      fc::sha256 hash( uint32_t a, uint32_t b )const
+      {
+         unsigned char rest[HEADER_SIZE - SHA256_BLOCK_SIZE];
+         memcpy( rest, tail, sizeof(tail) );
+         memcpy( rest + sizeof(tail), &a, sizeof(a) );
+         memcpy( rest + sizeof(tail) + sizeof(a), &b, sizeof(b) );
+
+         // the context is a plain struct, a copy carries the midstate
+         sha256_ctx ctx = prefix;
+         sha256_update( &ctx, rest, sizeof(rest) );
+
+         fc::sha256 inner;
+         sha256_final( &ctx, (unsigned char*)&inner );
+         fc::sha256 result;
+         sha256( (const unsigned char*)&inner, sizeof(inner), (unsigned char*)&result );
+         return result;
+      }
+
+   private:
+      sha256_ctx prefix;
+      char       tail[PREFIX_SIZE - SHA256_BLOCK_SIZE];
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <sstream>
+#include <string>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ *  Counts latency samples in power of two microsecond buckets, bucket i
+ *  holds samples below 2^i us.
+ */
+class latency_histogram
+{
+   public:
+      enum { BUCKETS = 32 };
+
+      latency_histogram():samples(0),worst(0)
+      {
+         memset( counts, 0, sizeof(counts) );
+      }
+
+      void record( int64_t us )
+      {
+         if( us < 0 ) us = 0;
+         uint32_t b = 0;
+         while( b < BUCKETS-1 && (int64_t(1) << b) <= us ) ++b;
+         ++counts[b];
+         ++samples;
+         if( us > worst ) worst = us;
+      }
+
+      uint64_t count()const   { return samples; }
+      int64_t  max_us()const  { return worst; }
+      uint64_t bucket( uint32_t b )const { return counts[b]; }
+
+      /** @return the upper bound in us of the bucket holding the q quantile */
+      int64_t quantile_us( double q )const
+      {
+         const uint64_t rank = uint64_t( q * samples );
+         uint64_t seen = 0;
+         for( uint32_t b = 0; b < BUCKETS; ++b )
+         {
+            seen += counts[b];
+            if( seen > rank ) return int64_t(1) << b;
+         }
+         return worst;
+      }
+
+      /** one line summary such as "n=12 p50<=256us p99<=1024us max=700us" */
+      std::string summary()const
+      {
+         std::stringstream ss;
+         ss<<"n="<<samples;
+         if( samples )
+            ss<<" p50<="<<quantile_us(0.5)<<"us p99<="<<quantile_us(0.99)<<"us max="<<worst<<"us";
+         return ss.str();
+      }
+
+   private:
+      uint64_t counts[BUCKETS];
+      uint64_t samples;
+      int64_t  worst;
+};
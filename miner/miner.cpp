@@ -4,15 +4,23 @@
 #include <bts/network/stcp_socket.hpp>
 #include <algorithm>
 #include "momentum.hpp"
+#include "sha512_lanes.hpp"
 #include "work_message.hpp"
+#include "table_memory.hpp"
+#include "latency_histogram.hpp"
+#include "header_hash.hpp"
 #include <fc/io/raw.hpp>
-#include <fc/io/datastream.hpp>
 #include <fc/network/resolve.hpp>
+#include <fc/network/tcp_socket.hpp>
 #include <fc/thread/thread.hpp>
+#include <fc/thread/mutex.hpp>
+#include <fc/thread/scoped_lock.hpp>
 #include <fc/time.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/variant.hpp>
 #include <boost/thread/thread.hpp>
+#include <atomic>
+#include <sstream>
 
 #define COIN 100000000ll
 fc::sha256 Hash( char* b, size_t len )
@@ -22,55 +30,312 @@ fc::sha256 Hash( char* b, size_t len )
    return round2;
 }
 
-extern volatile bool   cancel_search;
-uint64_t               total_hashes = 0;
+momentum_cancel        search_cancel;
+std::atomic<uint64_t>  total_hashes(0);
+momentum_engine        engine       = TABLE_ENGINE;
+bool                   pipeline_search = false;
+uint16_t               stats_port   = 0;
+uint64_t               memory_budget = 0;
 
-uint64_t& get_thread_count();
+/** searches of every group submit on the same socket, a share is one write */
+fc::mutex              submit_lock;
+const fc::time_point   process_start = fc::time_point::now();
 
+/** time from receiving new work until every search thread has stopped */
+latency_histogram      switch_latency;
 
-void start_work( const bts::network::stcp_socket_ptr& sock, work_message msg, int instance = 0)
+/** totals since start, reported next to the search thread counters */
+struct miner_counters
 {
-   while( !cancel_search )
-   {
-      auto mid = Hash( (char*)&msg.header, 80 );
-      auto pairs = momentum_search( mid, instance );
+   miner_counters():pairs_found(0),pairs_tested(0),shares_submitted(0),cancel_wait_us(0){}
 
-      total_hashes += pairs.size();
-      for( auto itr = pairs.begin(); itr != pairs.end(); ++itr )
-      {
-          msg.header.birthday_a = itr->first;
-          msg.header.birthday_b = itr->second;
-          auto result = Hash( (char*)&msg.header, 88 );
-          std::reverse((char*)&result, ((char*)&result) + sizeof(result) );
+   std::atomic<uint64_t> pairs_found;
+   std::atomic<uint64_t> pairs_tested;       ///< distinct pairs hashed against the share target
+   std::atomic<uint64_t> shares_submitted;
+   std::atomic<uint64_t> cancel_wait_us;     ///< new work waiting for the old search to stop
+} counters;
 
-          if( (((unsigned char*)&result)[0] < 0x03 ) )
+
+typedef std::vector< std::pair<uint32_t,uint32_t> > pair_list;
+
+/**
+ *  Sends the first pair that meets the share target, if any, by patching
+ *  header and the pair into frame, the group's encoded work.
+ *
+ *  (a,b) and (b,a) are different headers and either may meet the target, so
+ *  only exact duplicates are dropped before hashing.
+ */
+void submit_share( const bts::network::stcp_socket_ptr& sock, work_frame& frame, bitcoin::work header, pair_list pairs )
+{
+   std::sort( pairs.begin(), pairs.end() );
+   pairs.erase( std::unique( pairs.begin(), pairs.end() ), pairs.end() );
+
+   const pair_header_hasher hasher( (const char*)&header );
+   for( auto itr = pairs.begin(); itr != pairs.end(); ++itr )
+   {
+       counters.pairs_tested.fetch_add( 1, std::memory_order_relaxed );
+       auto result = hasher.hash( itr->first, itr->second );
+       std::reverse((char*)&result, ((char*)&result) + sizeof(result) );
+
+       if( (((unsigned char*)&result)[0] < 0x03 ) )
+       {
+          header.birthday_a = itr->first;
+          header.birthday_b = itr->second;
+             std::cout<<std::string(fc::time_point::now())<< " "<<std::string(result)<<"\n";
+          frame.set_header( header );
           {
-                std::cout<<std::string(fc::time_point::now())<< " "<<std::string(result)<<"\n";
-             auto data = fc::raw::pack(msg);
-             data.resize(192);
-             sock->write( data.data(), data.size() );
-             break;
+             fc::scoped_lock<fc::mutex> lock( submit_lock );
+             sock->write( frame.data(), frame.size() );
           }
+          counters.shares_submitted.fetch_add( 1, std::memory_order_relaxed );
+          break;
+       }
+   }
+}
+
+fc::future<pair_list> async_search( bitcoin::work header, int instance )
+{
+   return fc::async( [=]() mutable {
+      // a search queued just before the cancel must not allocate its table
+      if( search_cancel.canceled() ) return pair_list();
+      auto mid = Hash( (char*)&header, 80 );
+      return momentum_search( mid, instance, engine, search_cancel );
+   });
+}
+
+/**
+ *  Keeps the search for the next header nonce queued behind the running one,
+ *  alternating between table instances group and group + get_search_groups(),
+ *  which share the threads of the group.  Pool workers that finish their
+ *  last chunk of nonce N move straight on to the next nonce while the pairs
+ *  of N are checked and submitted here.
+ */
+void pipelined_work( const bts::network::stcp_socket_ptr& sock, work_frame& frame, bitcoin::work header, int group )
+{
+   const uint32_t        groups   = get_search_groups();
+   int                   instance = group;
+   fc::future<pair_list> running  = async_search( header, instance );
+   while( true )
+   {
+      if( search_cancel.canceled() )
+      {
+         running.wait();
+         return;
       }
+      bitcoin::work next = header;
+      next.nonce += groups;
+      instance = instance == group ? group + groups : group;
+      fc::future<pair_list> queued = async_search( next, instance );
+
+      auto pairs = running.wait();
+      if( search_cancel.canceled() )
+      {
+         // the work is stale, drop both searches without checking their pairs
+         queued.wait();
+         return;
+      }
+      total_hashes += pairs.size();
+      counters.pairs_found += pairs.size();
+      submit_share( sock, frame, header, pairs );
+
+      running = queued;
+      header  = next;
+   }
+}
+
+/**
+ *  Searches the header nonces of group, header.nonce and every
+ *  get_search_groups() after it, until the work is replaced.  frame holds
+ *  the work encoded for this group, shares are patched into it.
+ */
+void start_work( const bts::network::stcp_socket_ptr& sock, work_frame& frame, bitcoin::work header, int group )
+{
+   if( pipeline_search )
+   {
+      pipelined_work( sock, frame, header, group );
+      return;
+   }
+   const int instance = group;
+   while( !search_cancel.canceled() )
+   {
+      auto mid = Hash( (char*)&header, 80 );
+      auto pairs = momentum_search( mid, instance, engine, search_cancel );
+      if( search_cancel.canceled() ) return;
+
+      total_hashes += pairs.size();
+      counters.pairs_found += pairs.size();
+      submit_share( sock, frame, header, pairs );
       fc::usleep( fc::microseconds(100) );
-      msg.header.nonce++;
+      header.nonce += get_search_groups();
+   }
+}
+
+/**
+ *  One JSON object with every counter.  Counters only grow, rates are left
+ *  to whoever reads them twice.
+ */
+std::string stats_json()
+{
+   const std::vector<momentum_thread_counters> threads = get_momentum_counters();
+   momentum_thread_counters total;
+   std::stringstream ss;
+   ss<<"{\"uptime_us\":"<<(fc::time_point::now() - process_start).count()
+     <<",\"engine\":\""<<momentum_engine_name( engine )<<"\""
+     <<",\"threads\":[";
+   for( uint32_t i = 0; i < threads.size(); ++i )
+   {
+      ss<<(i ? "," : "")<<"{\"sha512_calls\":"<<threads[i].hashes
+        <<",\"table_stores\":"<<threads[i].stores
+        <<",\"collisions\":"<<threads[i].collisions<<"}";
+      total.hashes     += threads[i].hashes;
+      total.stores     += threads[i].stores;
+      total.collisions += threads[i].collisions;
    }
+   ss<<"],\"sha512_calls\":"<<total.hashes
+     <<",\"table_stores\":"<<total.stores
+     <<",\"collisions\":"<<total.collisions
+     <<",\"pairs_found\":"<<counters.pairs_found.load()
+     <<",\"pairs_tested\":"<<counters.pairs_tested.load()
+     <<",\"shares_submitted\":"<<counters.shares_submitted.load()
+     <<",\"cancel_wait_us\":"<<counters.cancel_wait_us.load()
+     <<",\"switch_latency\":{\"count\":"<<switch_latency.count();
+   if( switch_latency.count() )
+      ss<<",\"p50_us\":"<<switch_latency.quantile_us(0.5)
+        <<",\"p99_us\":"<<switch_latency.quantile_us(0.99)
+        <<",\"max_us\":"<<switch_latency.max_us();
+   ss<<"}}";
+   return ss.str();
+}
+
+/**
+ *  Answers every connection to 127.0.0.1:port with stats_json() as a
+ *  HTTP/1.0 response and closes it, whatever was requested.
+ */
+void serve_stats( uint16_t port )
+{
+   fc::tcp_server server;
+   server.listen( fc::ip::endpoint( fc::ip::address( "127.0.0.1" ), port ) );
+   while( true )
+   {
+      fc::tcp_socket sock;
+      server.accept( sock );
+      try
+      {
+         char request[1024];
+         sock.readsome( request, sizeof(request) );
+
+         const std::string body = stats_json();
+         std::stringstream reply;
+         reply<<"HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: "<<body.size()<<"\r\n\r\n"<<body;
+         const std::string data = reply.str();
+         for( size_t sent = 0; sent < data.size(); )
+            sent += sock.writesome( data.data() + sent, data.size() - sent );
+         sock.close();
+      }
+      catch( const fc::exception& e )
+      {
+         wlog( "${w}", ("w",e.to_detail_string() ) );
+      }
+   }
+}
+
+/** threads a search group needs before splitting off another one pays */
+#define MIN_GROUP_THREADS 8
+
+/**
+ *  The most search groups whose instances fit in budget while every group
+ *  keeps MIN_GROUP_THREADS threads, never less than one.
+ */
+uint32_t search_groups_for( uint64_t budget )
+{
+   const uint32_t threads   = uint32_t( get_thread_count() );
+   const uint32_t instances = pipeline_search ? 2 : 1;
+   uint32_t groups = std::max<uint32_t>( 1, std::min<uint32_t>( threads / MIN_GROUP_THREADS,
+                                                                MAX_SEARCH_INSTANCES / instances ) );
+   for( ; groups > 1; --groups )
+   {
+      uint64_t needed = 0;
+      for( uint32_t g = 0; g < groups; ++g )
+         needed += instances * momentum_search_bytes( engine, threads * (g+1) / groups - threads * g / groups );
+      if( needed <= budget ) break;
+   }
+   return groups;
+}
+
+/**
+ *  Removes --name=value options from argv, leaving the positional arguments.
+ *  @return false if an option is not recognized
+ */
+bool parse_options( int& argc, char** argv )
+{
+    int positional = 1;
+    for( int i = 1; i < argc; ++i )
+    {
+       std::string arg = argv[i];
+       if( arg.compare( 0, 2, "--" ) != 0 )
+       {
+          argv[positional++] = argv[i];
+          continue;
+       }
+       auto eq = arg.find( '=' );
+       std::string name  = arg.substr( 2, eq == std::string::npos ? std::string::npos : eq-2 );
+       std::string value = eq == std::string::npos ? std::string() : arg.substr( eq+1 );
+       if( name == "engine" && parse_momentum_engine( value, engine ) )
+          continue;
+       if( name == "table-pages" && parse_table_page_policy( value, get_table_memory_policy().pages ) )
+          continue;
+       if( name == "table-numa" && parse_table_numa_policy( value, get_table_memory_policy() ) )
+          continue;
+       if( name == "depth" && parse_momentum_depth( value, get_momentum_depth() ) )
+          continue;
+       if( name == "stats-port" && !value.empty() && value.size() <= 5 &&
+           value.find_first_not_of( "0123456789" ) == std::string::npos && atoi( value.c_str() ) <= 65535 )
+       {
+          stats_port = uint16_t( atoi( value.c_str() ) );
+          continue;
+       }
+       if( name == "memory-budget" && parse_byte_size( value, memory_budget ) )
+          continue;
+       if( name == "cuckoo-memory" && parse_byte_size( value, get_cuckoo_table_bytes() ) )
+          continue;
+       if( name == "bloom-memory" && parse_byte_size( value, get_bloom_filter_bytes() ) )
+          continue;
+       if( name == "pipeline" )
+       {
+          pipeline_search = true;
+          continue;
+       }
+       std::cerr<<"Invalid option "<<arg<<"\n";
+       return false;
+    }
+    argc = positional;
+    return true;
 }
 
 int main( int argc, char** argv )
 {
     try {
+       if( !parse_options( argc, argv ) )
+       {
+            std::cerr<<"Options: --engine=table|bucket|cuckoo|bloom|sort --table-pages=small|thp|2m|1g\n"
+                     <<"         --table-numa=first-touch|interleave|NODE --pipeline\n"
+                     <<"         --depth=full|auto|NONCES --stats-port=PORT\n"
+                     <<"         --memory-budget=BYTES[K|M|G] --cuckoo-memory=BYTES[K|M|G]\n"
+                     <<"         --bloom-memory=BYTES[K|M|G]\n";
+            return -1;
+       }
        if( argc == 1 )
        {
-            std::cerr<<"Usage: "<<argv[0]<<" HOST PTS_ADDRESS [THREADS=HARDWARE]\n";
-            std::cerr<<"Performing Benchmark...\n";
+            std::cerr<<"Usage: "<<argv[0]<<" [OPTIONS] HOST PTS_ADDRESS [THREADS=HARDWARE]\n";
+            std::cerr<<"Performing Benchmark... ("<<momentum_engine_name(engine)<<" engine, "
+                                                 <<get_birthday_hasher()->name<<" birthday hasher)\n";
             fc::sha256 base;
             auto start = fc::time_point::now();
             uint32_t total = 0;
             for( uint32_t i = 0; i < 30; ++i )
             {
                base._hash[0]=i;
-              auto pairs = momentum_search( base, 0 );
+              auto pairs = momentum_search( base, 0, engine );
               total += pairs.size();
               std::cerr<<"HPM: "<< total / ((fc::time_point::now()-start).count()/60000000.0 ) <<"\r";
             }
@@ -85,12 +350,36 @@ int main( int argc, char** argv )
        }
        std::string host    = argv[1];
        std::string ptsaddr = argv[2];
+       if( ptsaddr.size() > work_frame::MAX_ADDRESS )
+       {
+            std::cerr<<"PTS_ADDRESS is longer than "<<int(work_frame::MAX_ADDRESS)<<" characters\n";
+            return -1;
+       }
        if( argc == 4 )
        {
           get_thread_count() = fc::variant( std::string(argv[3]) ).as_uint64();
        }
+       if( memory_budget )
+       {
+          get_search_groups() = search_groups_for( memory_budget );
+          const uint32_t instances = get_search_groups() * (pipeline_search ? 2 : 1);
+          uint64_t needed = 0;
+          for( uint32_t i = 0; i < instances; ++i )
+             needed += momentum_search_bytes( engine, search_group_threads( i ) );
+          std::cerr<<get_search_groups()<<" search groups of "<<get_thread_count()<<" threads, "
+                   <<(needed >> 20)<<" MB of tables\n";
+          if( needed > memory_budget )
+             std::cerr<<"warning: a single search needs more than the "<<(memory_budget >> 20)<<" MB memory budget\n";
+       }
+
+       if( stats_port )
+          fc::async( [=](){ serve_stats( stats_port ); } );
 
        std::vector<fc::ip::endpoint> eps = fc::resolve( host, 4444 );
+
+       // outlive the connection, the searches write through their frame until waited on
+       std::vector<work_frame>         group_frames( get_search_groups() );
+       std::vector< fc::future<void> > search_complete;
        while( true )
        {
           bts::network::stcp_socket_ptr sock = std::make_shared<bts::network::stcp_socket>();
@@ -120,14 +409,9 @@ int main( int argc, char** argv )
                   }
               }
          
-              fc::array<char,192> packet;
-              fc::future<void>    search_complete;
-              fc::future<void>    search_complete1;
-
-              work_message msg;
-              msg.ptsaddr = ptsaddr;
-              auto data = fc::raw::pack(msg);
-              data.resize(192);
+              // reused for every work, none of the receive path allocates after the first
+              work_frame                      packet;
+              work_message                    msg;
 
               fc::time_point start = fc::time_point::now();
               std::cout<<"\n";
@@ -143,16 +427,25 @@ int main( int argc, char** argv )
               int count = 0;
               while( true )
               {
-                  sock->read( packet.data, sizeof(packet) );
+                  sock->read( packet.data(), packet.size() );
                   
-                  cancel_search = true;
-                  if( search_complete.valid() ) search_complete.wait();
-              //    if( search_complete1.valid() ) search_complete1.wait();
-                  cancel_search = false;
+                  auto received = fc::time_point::now();
+                  search_cancel.cancel();
+                  if( !search_complete.empty() )
+                  {
+                     for( uint32_t g = 0; g < search_complete.size(); ++g )
+                        search_complete[g].wait();
+                     const int64_t waited = (fc::time_point::now() - received).count();
+                     switch_latency.record( waited );
+                     counters.cancel_wait_us += waited;
+                  }
+                  search_cancel.reset();
                     
-                  work_message msg;
-                  fc::datastream<const char*> ds(packet.data,sizeof(packet) );
-                  fc::raw::unpack( ds, msg );
+                  if( !packet.decode( msg ) )
+                  {
+                     wlog( "ignoring malformed work frame" );
+                     continue;
+                  }
                   if( count ) 
                   {
                   std::cout<<"  shares: "        <<(msg.user.valid)
@@ -166,6 +459,7 @@ int main( int argc, char** argv )
                            <<"  fee: "       << double(msg.pool_fee*100) <<"%"
                            <<"  address: "   << ptsaddr
                            <<"  hpm: "       << total_hashes / ((fc::time_point::now() - start ).count()/60000000.0 )
+                           <<"  switch: "    << switch_latency.summary()
                            <<"\n";
                   }
                   else
@@ -175,14 +469,34 @@ int main( int argc, char** argv )
                   ++count;
          
                   msg.ptsaddr = ptsaddr;
-                  search_complete  = fc::async( [=](){ start_work( sock, msg, 0 ); } ); 
-             //     search_complete1 = fc::async( [=](){ start_work( sock, msg, 1 ); } ); 
+                  search_complete.clear();
+                  for( uint32_t g = 0; g < group_frames.size(); ++g )
+                  {
+                     // the searches of the previous work are done, their frames are free
+                     work_frame&   frame  = group_frames[g];
+                     bitcoin::work header = msg.header;
+                     header.nonce += g;
+                     frame.encode( msg );
+                     search_complete.push_back( fc::async( [=,&frame](){ start_work( sock, frame, header, g ); } ) );
+                  }
               }
           } 
           catch ( fc::exception& e )
           {
               std::cerr<< e.to_detail_string() <<"\n";
-              cancel_search = true;
+              search_cancel.cancel();
+              for( uint32_t g = 0; g < search_complete.size(); ++g )
+              {
+                 try
+                 {
+                    search_complete[g].wait();
+                 }
+                 catch ( const fc::exception& )
+                 {
+                    // a share write on the dead socket, the search is over either way
+                 }
+              }
+              search_complete.clear();
           }
        } // while(true)
     } catch ( boost::exception& e )
@@ -4,15 +4,160 @@
 #include <fc/crypto/sha256.hpp>
 #include <fc/crypto/ripemd160.hpp>
 #include <fc/reflect/reflect.hpp>
+#include <fc/time.hpp>
+#include <string>
+#include <vector>
+#include <atomic>
 
 #define MAX_MOMENTUM_NONCE  (1<<26)
+#define BIRTHDAYS_PER_HASH  8    ///< birthdays from one SHA-512, nonces n - n%8 to n - n%8 + 7
+
+/**
+ *  Searches with different instances use separate tables and may overlap.
+ *  Instance i runs on the threads of search group i % get_search_groups().
+ */
+#define MAX_SEARCH_INSTANCES 16
 
    typedef fc::sha256     pow_seed_type;
 
+   /** search threads, one per core unless set on the command line */
+   uint64_t& get_thread_count();
+
+   enum momentum_engine
+   {
+      TABLE_ENGINE,   ///< one shared table, every store is a random write
+      BUCKET_ENGINE,  ///< per thread radix buckets resolved one at a time in cache
+      CUCKOO_ENGINE,  ///< two choice table of get_cuckoo_table_bytes(), for hosts short of memory
+      BLOOM_ENGINE,   ///< two hashing passes, Bloom filters pick the birthdays worth storing
+      SORT_ENGINE     ///< every birthday in one array, radix sorted, finds every collision
+   };
+
+   /** memory of each CUCKOO_ENGINE table, used as a power of two from 256 MB to 1 GB */
+   uint64_t& get_cuckoo_table_bytes();
+
+   /**
+    *  memory of the first BLOOM_ENGINE filter, a power of two.  Filters that
+    *  fit the last level cache keep DRAM idle but let more false positives
+    *  through to the exact pass.
+    */
+   uint64_t& get_bloom_filter_bytes();
+
+   /**
+    *  Stops a running momentum_search, may be signaled from any thread.  The
+    *  search threads poll it between hashes and return what they have found.
+    */
+   class momentum_cancel
+   {
+      public:
+         momentum_cancel():flag(false){}
+
+         void cancel()        { flag.store( true, std::memory_order_relaxed ); }
+         void reset()         { flag.store( false, std::memory_order_relaxed ); }
+         bool canceled()const { return flag.load( std::memory_order_relaxed ); }
+
+      private:
+         std::atomic<bool> flag;
+   };
+
    /** 
     *  @return all collisions found in the nonce search space 
     */
-   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head, int instance = 0 );
+   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head, int instance = 0,
+                                                                momentum_engine engine = TABLE_ENGINE );
+   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head, int instance,
+                                                                momentum_engine engine, const momentum_cancel& cancel );
    bool momentum_verify( pow_seed_type head, uint32_t a, uint32_t b );
 
+   struct momentum_share
+   {
+      pow_seed_type head;
+      uint32_t      a;
+      uint32_t      b;
+   };
+
+   /**
+    *  momentum_verify for count shares at once, valid[i] is the result for
+    *  shares[i].  Both birthdays of a share are hashed in one multi lane call
+    *  unless they share a digest or are still cached.
+    */
+   void momentum_verify_batch( const momentum_share* shares, uint32_t count, bool* valid );
+
+   /**
+    *  momentum_verify_batch caches recently hashed birthday groups per verify
+    *  thread, this drops them when the work they were computed for is gone.
+    */
+   void momentum_verify_new_work();
+
+   /**
+    *  Number of groups get_thread_count() threads are split into, each group
+    *  searches its own header nonce with its own table.  Many threads on one
+    *  table contend for its cache lines and memory bandwidth, so on wide
+    *  hosts several narrower searches find more pairs per second.
+    */
+   uint32_t& get_search_groups();
+
+   /** threads a search on instance uses, at least one */
+   uint32_t search_group_threads( int instance );
+
+   /** memory one search instance allocates when run with threads threads */
+   uint64_t momentum_search_bytes( momentum_engine engine, uint32_t threads );
+
+   /** wall clock time of each stage of the last search on an instance */
+   struct momentum_search_stats
+   {
+      momentum_search_stats():reset_us(0),generate_us(0),resolve_us(0),nonces(0){}
+
+      int64_t        reset_us;      ///< preparing the table or buckets
+      int64_t        generate_us;   ///< hashing and storing every birthday
+      int64_t        resolve_us;    ///< bucket engine only, finding collisions per bucket
+      uint32_t       nonces;        ///< nonces covered, less than MAX_MOMENTUM_NONCE if cut short
+      fc::time_point end;
+   };
+   momentum_search_stats& get_momentum_search_stats( int instance = 0 );
+
+   /**
+    *  Work done by one search thread since the process started.  Each thread
+    *  only writes its own counters, so reading them never slows the search.
+    */
+   struct momentum_thread_counters
+   {
+      momentum_thread_counters():hashes(0),stores(0),collisions(0){}
+
+      uint64_t hashes;       ///< SHA-512 digests of birthday groups
+      uint64_t stores;       ///< birthdays written to the table or buckets
+      uint64_t collisions;   ///< matching birthdays found, each gives two pairs
+   };
+
+   /** one entry per search thread started so far, safe to call from any thread */
+   std::vector<momentum_thread_counters> get_momentum_counters();
+
+   /**
+    *  How much of the nonce space a search covers.  Pairs found among fewer
+    *  nonces are just as valid, but the number found grows with the square
+    *  of the nonces covered.
+    */
+   enum momentum_depth_mode
+   {
+      FULL_DEPTH,    ///< every nonce up to MAX_MOMENTUM_NONCE
+      FIXED_DEPTH,   ///< the first momentum_depth::nonces nonces
+      AUTO_DEPTH     ///< table engine stops once more nonces would lower the pair rate
+   };
+
+   struct momentum_depth
+   {
+      momentum_depth():mode(FULL_DEPTH),nonces(MAX_MOMENTUM_NONCE){}
+
+      momentum_depth_mode mode;
+      uint32_t            nonces;
+   };
+
+   /** the depth used by every momentum_search, set from the command line */
+   momentum_depth& get_momentum_depth();
+
+   /** accepts full, auto or a nonce count for FIXED_DEPTH */
+   bool parse_momentum_depth( const std::string& name, momentum_depth& depth );
+
+   const char* momentum_engine_name( momentum_engine engine );
+   bool        parse_momentum_engine( const std::string& name, momentum_engine& engine );
+
 
@@ -17,20 +17,21 @@
 #include <iostream>
 #include <fc/crypto/hex.hpp>
 #include "momentum.hpp"
+#include "spsc_queue.hpp"
+#include "share_ledger.hpp"
+#include "duplicate_detector.hpp"
+#include "latency_histogram.hpp"
 
 #include <boost/exception/all.hpp>
+#include <boost/thread/thread.hpp>
 #include <fstream>
+#include <atomic>
+#include <mutex>
 #include <stdint.h>
 
 using namespace bts::network;
 #define COIN 100000000ll
 
-struct user_stats
-{
-    user_record                  record;
-    std::unordered_set<uint64_t> recent_shares;
-};
-
 fc::sha256 Hash( char* b, size_t len )
 {
    auto round1 = fc::sha256::hash(b,len);
@@ -53,24 +54,31 @@ uint64_t get_reward( uint64_t block_num )
 
 uint64_t         total_paid               = 0;
 uint64_t         total_earned             = 0;
-uint64_t         all_shares               = 0;
+std::atomic<uint64_t> all_shares(0);
 uint64_t         submited                 = 0;
-uint64_t         stale                    = 0;
-uint64_t         total_invalid            = 0;
+std::atomic<uint64_t> stale(0);
+std::atomic<uint64_t> total_invalid(0);
+std::atomic<uint64_t> connection_count(0);
 fc::time_point   last_window_start        = fc::time_point::now();
 uint64_t         last_window_start_shares = 0;
 double           share_per_min            = 0;
-bool             server_ok                = false;
+std::atomic<bool> server_ok(false);
 
 struct connection_data
 {
+    connection_data():generation(0),writing(false){}
+
     user_record     user;
     stcp_socket_ptr sock;
+    work_frame      frame;          ///< the work last written, reused by every write
+    uint64_t        generation;     ///< connection_shard::work_generation of frame
+    bool            writing;        ///< frame is on its way, the writer follows up with newer work
+    fc::time_point  write_started;  ///< a write older than config::write_timeout_ms drops the miner
 };
 
 struct config
 {
-    config():fee(0),auto_pay_amount(0),port(4444){}
+    config():fee(0),auto_pay_amount(0),port(4444),verify_threads(0),network_threads(0),flush_ms(250),flush_shares(1000),recent_shares(1<<20),write_timeout_ms(1000){}
 
     double fee;
     double auto_pay_amount;
@@ -80,9 +88,100 @@ struct config
     std::string user;
     std::string pass;
 
+    uint32_t    verify_threads;   ///< 0 for one per core
+    uint32_t    network_threads;  ///< 0 for one per core
+    uint32_t    flush_ms;         ///< longest time share counts stay unwritten
+    uint32_t    flush_shares;     ///< most shares counted between two writes
+    uint32_t    recent_shares;    ///< shares remembered at least to catch duplicates
+    uint32_t    write_timeout_ms; ///< a miner that takes longer to accept new work is dropped
+};
+
+FC_REFLECT( config, (host)(port)(user)(pass)(fee)(auto_pay_amount)(verify_threads)(network_threads)(flush_ms)(flush_shares)(recent_shares)(write_timeout_ms) )
+
+/**
+ *  A share waiting in connection_shard::pending_shares, the connection that
+ *  sent it waits on done while a verify thread fills in the result.  The
+ *  batch shares ownership, so a waiter that is canceled leaves the job alive
+ *  for the verify thread still writing to it.
+ */
+struct share_job
+{
+    share_job():meets_share_target(false),meets_block_target(false),valid(false){}
+
+    bitcoin::work                header;
+    bool                         meets_share_target;
+    bool                         meets_block_target;
+    bool                         valid;
+    fc::promise<void>::ptr       done;
 };
+typedef std::shared_ptr<share_job> share_job_ptr;
+typedef std::vector<share_job_ptr> share_batch;
+
+/** a verified share on its way from a network thread to the accounting stage */
+struct share_result
+{
+    share_result():valid(false){}
+
+    std::string       key;
+    bool              valid;
+    fc::ip::endpoint  from;
+};
+
+/**
+ *  A network thread and the connections it owns.  Only thread touches the
+ *  members, except results which the accounting stage pops.
+ *
+ *  At most one broadcast runs per shard, work that arrives meanwhile only
+ *  replaces current_work and the running broadcast repeats for whoever did
+ *  not get it yet.
+ */
+struct connection_shard
+{
+    connection_shard():verifying(false),results(1<<14),work_generation(0),broadcasting(false),rebroadcast(false){}
+
+    std::unique_ptr<fc::thread>                            thread;
+    std::unordered_map<fc::ip::endpoint,connection_data>   connections;
+    bitcoin::work                                          current_work;
+    share_batch                                            pending_shares;
+    bool                                                   verifying;
+    spsc_queue<share_result>                               results;
+
+    uint64_t                                               work_generation;   ///< server::work_generation of current_work
+    bool                                                   broadcasting;
+    bool                                                   rebroadcast;       ///< current_work changed during the broadcast
+    work_frame                                             broadcast;         ///< new work, patched for each recipient
+    std::vector< fc::future<void> >                        sends;             ///< writes of the running broadcast
+};
+
+/** all of the hashing for count jobs of a batch, runs on a verify thread */
+void verify_jobs( const share_job_ptr* jobs, uint32_t count )
+{
+    std::vector<momentum_share> shares;
+    std::vector<share_job*>     checked;
+    shares.reserve( count );
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        share_job& job = *jobs[i];
+        auto result = Hash( (char*)&job.header, 88 );
+        std::reverse((char*)&result, ((char*)&result) + sizeof(result) );
+
+        job.meets_share_target = ((unsigned char*)&result)[0] < 0x3f;
+        job.meets_block_target = ((uint8_t*)&result)[0] == 0x00 && ((uint8_t*)&result)[1] == 0x00;
+        if( !job.meets_share_target ) continue;
+
+        momentum_share share;
+        share.head = Hash( (char*)&job.header, 80 );
+        share.a    = job.header.birthday_a;
+        share.b    = job.header.birthday_b;
+        shares.push_back( share );
+        checked.push_back( jobs[i].get() );
+    }
 
-FC_REFLECT( config, (host)(port)(user)(pass)(fee)(auto_pay_amount) )
+    std::unique_ptr<bool[]> valid( new bool[shares.size()+1] );
+    momentum_verify_batch( shares.data(), shares.size(), valid.get() );
+    for( uint32_t i = 0; i < checked.size(); ++i )
+        checked[i]->valid = valid[i];
+}
 
 
 class server
@@ -90,6 +189,7 @@ class server
     public:
           fc::thread*                                            main_thread;
           bts::db::level_map<std::string,user_record>            user_database;
+          share_ledger                                           ledger;
           fc::thread                                             btc_thread;
           fc::bigint                                             share_target;
           uint64_t                                               wallet_balance;
@@ -97,14 +197,25 @@ class server
           std::ofstream                                          payment_log;
 
           fc::future<void>                                       accept_loop_complete;
-          std::unordered_map<fc::ip::endpoint,connection_data>   connections;
+          fc::future<void>                                       accounting_complete;
+          std::vector< std::unique_ptr<connection_shard> >       shards;
+          uint32_t                                               next_shard;
           fc::tcp_server                                         tcp_serv;
 
           config                                                 conf;
                                                                  
           std::unique_ptr<bitcoin::client>                       bitcoin_client;
-          std::unordered_set<uint64_t>                           recent_shares;
+          std::unique_ptr<duplicate_detector>                    recent_shares;
           bitcoin::work                                          current_work;
+          uint64_t                                               work_generation;  ///< counts update_work calls
+          fc::time_point                                         notify_start;
+          uint32_t                                               notify_pending;   ///< shards still sending work_generation
+          uint32_t                                               notified;
+          std::mutex                                             notify_lock;      ///< print_stats reads from btc_thread
+          latency_histogram                                      notify_latency;   ///< new block until every shard sent it
+
+          std::vector< std::unique_ptr<fc::thread> >             verify_threads;
+          std::atomic<uint32_t>                                  next_verify_thread;  ///< where the next batch starts, shards share the pool
 
           void load_database()
           {
@@ -121,6 +232,7 @@ class server
 
           void dump_balances()
           {
+               ledger.flush();
                auto itr = user_database.begin();
                while( itr.valid() )
                {
@@ -133,6 +245,7 @@ class server
 
           void pay_all()
           {
+               ledger.flush();
                auto itr = user_database.begin();
                while( itr.valid() )
                {
@@ -157,14 +270,12 @@ class server
                              ilog( "sent ${amnt} to ${key} ${trx}", ("amnt",amount)("key",key)("trx",trx_id) );
                              return trx_id;
                            }).wait();
-                  payment_log << std::string(fc::time_point::now()) << ", " << key << ", " << amount <<", "<<trx_id;
+                  // the log line is on disk before the record, a crash in between leaves a payment to reconcile, never one forgotten
+                  payment_log << std::string(fc::time_point::now()) << ", " << key << ", " << amount <<", "<<trx_id<<std::endl;
                   total_paid += amount;
                   
-                  user_record user;
-                  auto itr = user_database.find(key);
-                  if( itr.valid() ) user = itr.value();
-                  user.total_paid += amount;
-                  user_database.store(key,user);
+                  ledger.record(key).total_paid += amount;
+                  ledger.store(key);
               } 
               catch ( ... )
               {
@@ -186,6 +297,8 @@ class server
                   last_window_start_shares = found_shares;
                   last_window_start = now;
               }
+              duplicate_detector::counters dups;
+              if( recent_shares ) dups = recent_shares->get_counters();
               std::cerr<<"  wallet: "       <<(wallet_balance)/double(COIN)
                        <<"  mature: "       <<(mature_balance)/double(COIN)
                   //     <<"  total_earned: " <<total_earned/double(COIN)
@@ -193,15 +306,18 @@ class server
                   //     <<"  total_balance: "<<(total_earned-total_paid)/double(COIN)
                        <<"  pool: "<<(all_shares)
                        <<"  stale: "<<stale
-                       <<"  connections: "<<connections.size()
+                       <<"  dup: "<<dups.duplicates<<"/"<<dups.checked
+                       <<"  forgotten: "<<dups.forgotten
+                       <<"  connections: "<<connection_count
                        <<"  spm:"<<share_per_min
+                       <<"  notify: "<<notify_summary()
 		      <<" \r";
           }
 
 
 
           server()
-          :wallet_balance(0)
+          :ledger(user_database),wallet_balance(0),next_shard(0),work_generation(0),notify_pending(0),notified(0),next_verify_thread(0)
           {
               fc::sha256 share_tar;
               memset( (char*)&share_tar, 0xff, sizeof(share_tar) );
@@ -233,6 +349,12 @@ class server
                       accept_loop_complete.cancel();
                       accept_loop_complete.wait();
                   }
+                  if( accounting_complete.valid() )
+                  {
+                      accounting_complete.cancel();
+                      accounting_complete.wait();
+                  }
+                  ledger.flush();
               } 
               catch ( const fc::canceled_exception& e )
               {
@@ -253,10 +375,31 @@ class server
               btc_thread.async( [=](){ bitcoind_thread(); } );
           }
 
+          void start_verify_threads()
+          {
+              uint32_t count = conf.verify_threads ? conf.verify_threads : boost::thread::hardware_concurrency();
+              for( uint32_t i = 0; i < std::max( 1u, count ); ++i )
+                  verify_threads.push_back( std::unique_ptr<fc::thread>( new fc::thread( "verify" ) ) );
+          }
+
+          void start_network_threads()
+          {
+              recent_shares.reset( new duplicate_detector( conf.recent_shares ) );
+              ilog( "duplicate detector uses ${mb} MB", ("mb", recent_shares->bytes() >> 20) );
+              uint32_t count = conf.network_threads ? conf.network_threads : boost::thread::hardware_concurrency();
+              for( uint32_t i = 0; i < std::max( 1u, count ); ++i )
+              {
+                  shards.push_back( std::unique_ptr<connection_shard>( new connection_shard() ) );
+                  connection_shard* shard = shards.back().get();
+                  shard->thread.reset( new fc::thread( "network" ) );
+                  shard->thread->async( [=](){ watch_writes( *shard ); } );
+              }
+          }
+
 
           uint64_t get_next_nonce()
           {
-              static uint64_t next_nonce = 0;
+              static std::atomic<uint64_t> next_nonce(0);
               return next_nonce += (1<<12);
           }
 
@@ -325,139 +468,417 @@ class server
                   main_thread->async( [=](){ update_work(latest); } );
                   return;
               }
-              recent_shares.clear();
+              recent_shares->clear();
+              momentum_verify_new_work();
               current_work       = latest;
-              for( auto itr = connections.begin(); itr != connections.end(); ++itr )
+
+              const uint64_t generation = ++work_generation;
+              notify_start   = fc::time_point::now();
+              notify_pending = shards.size();
+              notified       = 0;
+              for( uint32_t s = 0; s < shards.size(); ++s )
               {
-                  fc::async( [=](){  send_work( itr->second, current_work ); } );
+                  connection_shard* shard = shards[s].get();
+                  shard->thread->async( [=](){ queue_broadcast( *shard, latest, generation ); } );
               }
           }
 
-          void send_work( const connection_data& con, const bitcoin::work& latest )
+          /** main thread, a shard is through sending the work of generation */
+          void broadcast_done( uint64_t generation, uint32_t sent )
+          {
+              // newer work replaced it, every shard reports again for that one
+              if( generation != work_generation ) return;
+              notified += sent;
+              if( --notify_pending ) return;
+
+              const int64_t us = (fc::time_point::now() - notify_start).count();
+              {
+                  std::lock_guard<std::mutex> lock( notify_lock );
+                  notify_latency.record( us );
+              }
+              ilog( "notified ${n} miners of new work in ${us} us", ("n",notified)("us",us) );
+          }
+
+          std::string notify_summary()
+          {
+              std::lock_guard<std::mutex> lock( notify_lock );
+              return notify_latency.summary();
+          }
+
+          /**
+           *  On shard's thread, makes latest the work of shard and sends it
+           *  unless a broadcast is already running, which then repeats with
+           *  the newest work once it is through.
+           */
+          void queue_broadcast( connection_shard& shard, const bitcoin::work& latest, uint64_t generation )
+          {
+              shard.current_work    = latest;
+              shard.work_generation = generation;
+              if( shard.broadcasting )
+              {
+                  shard.rebroadcast = true;
+                  return;
+              }
+
+              shard.broadcasting = true;
+              uint64_t sent_generation;
+              uint32_t sent;
+              do
+              {
+                  shard.rebroadcast = false;
+                  sent_generation   = shard.work_generation;
+                  sent              = broadcast_work( shard );
+              } while( shard.rebroadcast );
+              shard.broadcasting = false;
+
+              main_thread->async( [=](){ broadcast_done( sent_generation, sent ); } );
+          }
+
+          /**
+           *  Writes con.frame on shard's thread, then the newest work of shard
+           *  for as long as it changed during the write.  The caller set
+           *  con.writing, which stays set until the last write is through and
+           *  keeps process_connection from dropping con under it.
+           */
+          void write_work( connection_shard& shard, connection_data& con )
+          {
+              stcp_socket_ptr sock = con.sock;
+              try
+              {
+                  while( true )
+                  {
+                      con.write_started = fc::time_point::now();
+                      sock->write( con.frame.data(), con.frame.size() );
+                      if( con.generation == shard.work_generation ) break;
+                      prepare_work( shard, con );
+                  }
+              }
+              catch ( ... )
+              {
+                  con.writing = false;
+                  throw;
+              }
+              con.writing = false;
+          }
+
+          /** closes every connection with a write older than conf.write_timeout_ms */
+          void watch_writes( connection_shard& shard )
+          {
+              const fc::microseconds       timeout = fc::milliseconds( conf.write_timeout_ms );
+              std::vector<stcp_socket_ptr> stalled;
+              try
+              {
+                  while( true )
+                  {
+                      fc::usleep( fc::milliseconds( conf.write_timeout_ms / 4 + 1 ) );
+                      const fc::time_point now = fc::time_point::now();
+                      for( auto itr = shard.connections.begin(); itr != shard.connections.end(); ++itr )
+                      {
+                          if( itr->second.writing && now - itr->second.write_started > timeout )
+                             stalled.push_back( itr->second.sock );
+                      }
+                      for( uint32_t i = 0; i < stalled.size(); ++i )
+                      {
+                          wlog( "closing a connection that did not take new work in time" );
+                          try { stalled[i]->close(); } catch ( const fc::exception& ) {}
+                      }
+                      stalled.clear();
+                  }
+              }
+              catch ( const fc::exception& e )
+              {
+                  wlog( "write watchdog stopped ${e}", ("e", e.to_detail_string()) );
+              }
+          }
+
+          /** the fields every connection gets alike */
+          work_message pool_work_message( const bitcoin::work& latest )
           {
               work_message msg;
               msg.type           = 0;
               msg.header         = latest;
-              msg.header.nonce   = get_next_nonce();
-              msg.user           = con.user;
               msg.pool_spm       = share_per_min;
 	      msg.pool_shares    = all_shares;
 	      msg.pool_earned    = wallet_balance;
 	      msg.mature_balance = mature_balance;
+              return msg;
+          }
+
+          /** encodes the work of shard for con into con.frame */
+          void prepare_work( connection_shard& shard, connection_data& con )
+          {
+              work_message msg = pool_work_message( shard.current_work );
+              msg.header.nonce   = get_next_nonce();
+              msg.user           = con.user;
+              con.frame.encode( msg );
+              con.generation = shard.work_generation;
+          }
 
-              auto data = fc::raw::pack( msg );
-              data.resize( 192 );
-              con.sock->write( data.data(), data.size() );
+          /**
+           *  Sends the work of shard to one connection from the calling fiber.
+           *  While another fiber writes to it there is nothing to do, that
+           *  writer follows up with the newest work itself.
+           */
+          void send_work( connection_shard& shard, connection_data& con )
+          {
+              if( con.writing ) return;
+              prepare_work( shard, con );
+              con.writing       = true;
+              con.write_started = fc::time_point::now();
+              write_work( shard, con );
           }
 
-          void increment_share_count( const std::string& key, bool valid )
+          /**
+           *  Sends the work of shard to every connection of it, only called by
+           *  queue_broadcast.  The frame is encoded once, only the nonce and
+           *  user record are patched into the frame of each connection.  All
+           *  writes start before any is waited on, so a miner that stopped
+           *  reading only delays itself, until watch_writes drops it.
+           *  Connections with a write in flight are skipped, their writer
+           *  follows up with the new work, as are those that already have it.
+           *
+           *  @return connections the work was written to
+           */
+          uint32_t broadcast_work( connection_shard& shard )
           {
-              if( !server_ok)
+              shard.broadcast.encode( pool_work_message( shard.current_work ) );
+
+              // nothing yields until every write is started, the map stays as it is
+              shard.sends.clear();
+              for( auto itr = shard.connections.begin(); itr != shard.connections.end(); ++itr )
               {
-                  wlog( "Sever ! ok" );
-                  return;
+                  connection_data& con = itr->second;
+                  if( con.writing || con.generation == shard.work_generation ) continue;
+                  con.frame = shard.broadcast;
+                  con.frame.set_nonce( get_next_nonce() );
+                  con.frame.set_user( con.user );
+                  con.generation    = shard.work_generation;
+                  con.writing       = true;
+                  con.write_started = fc::time_point::now();
+
+                  connection_data* c = &con;
+                  shard.sends.push_back( fc::async( [=,&shard](){ write_work( shard, *c ); } ) );
               }
 
-              user_record user;
-              auto itr = user_database.find(key);
-              if( itr.valid() )
+              uint32_t sent = 0;
+              for( uint32_t i = 0; i < shard.sends.size(); ++i )
               {
-                  user = itr.value();
+                  try
+                  {
+                     shard.sends[i].wait();
+                     ++sent;
+                  }
+                  catch ( const fc::exception& e )
+                  {
+                     // process_connection fails on the same socket and drops the connection
+                  }
               }
-              if( valid )
+              shard.sends.clear();
+              return sent;
+          }
+
+          /** only called by the accounting stage, @return the record of key after counting */
+          user_record increment_share_count( const std::string& key, bool valid )
+          {
+              if( !server_ok)
               {
-                user.valid++;
+                  wlog( "Sever ! ok" );
+                  return ledger.record(key);
               }
-              else
+
+              if( !valid )
               {
-                user.invalid++;
                 total_invalid++;
               }
-              user_database.store(key,user);
+              return ledger.count( key, valid );
+          }
+
+          /**
+           *  The single writer of share counts.  Drains the result queue of
+           *  every shard, then hands the updated records back to the network
+           *  threads for the next work they send.  The counts reach the
+           *  database in batches, every conf.flush_shares or conf.flush_ms.
+           */
+          void accounting_loop()
+          {
+             typedef std::vector< std::pair<fc::ip::endpoint,user_record> > updates;
+             std::vector<updates> replies( shards.size() );
+             share_result         r;
+             try
+             {
+                while( !accounting_complete.canceled() )
+                {
+                   bool idle = true;
+                   for( uint32_t s = 0; s < shards.size(); ++s )
+                   {
+                      while( shards[s]->results.pop( r ) )
+                      {
+                         idle = false;
+                         replies[s].push_back( std::make_pair( r.from, increment_share_count( r.key, r.valid ) ) );
+                      }
+                      if( replies[s].empty() ) continue;
+
+                      connection_shard* shard = shards[s].get();
+                      updates           done;
+                      done.swap( replies[s] );
+                      shard->thread->async( [=](){
+                          for( auto u = done.begin(); u != done.end(); ++u )
+                          {
+                              auto itr = shard->connections.find( u->first );
+                              if( itr != shard->connections.end() ) itr->second.user = u->second;
+                          }
+                      } );
+                   }
+                   if( ledger.flush_due( conf.flush_shares, fc::milliseconds( conf.flush_ms ) ) )
+                      ledger.flush();
+                   if( idle ) fc::usleep( fc::microseconds(1000) );
+                   else       fc::yield();
+                }
+             }
+             catch ( fc::canceled_exception& e )
+             {
+                ilog( "accounting canceled" );
+             }
+             catch ( fc::exception& e )
+             {
+                elog( "accounting stopped\n ${e}", ("e", e.to_detail_string() ) );
+             }
+          }
+
+          bool is_new_share( const bitcoin::work& header )
+          {
+              return recent_shares->insert( fc::city_hash64( (char*)&header, sizeof(header) ) );
           }
 
-          void process_connection( connection_data con )
+          /** runs on shard's thread for as long as the connection at ep is open */
+          void process_connection( connection_shard& shard, const fc::ip::endpoint& ep )
           {
+              connection_data& con = shard.connections[ep];
               try 
               {
-                 send_work( con, current_work );
+                 send_work( shard, con );
 
-                 fc::array<char,192> packet;
+                 // reused for every share of the connection, the strings keep their capacity
+                 work_frame   packet;
+                 work_message msg;
+                 share_result result;
                  while( true )
                  {
-                      con.sock->read( packet.data, packet.size() );
-                      fc::datastream<const char*> ds(packet.data, sizeof(packet) );
-                      
-                      work_message msg;
-                      fc::raw::unpack( ds, msg );
-                      
-                      bool is_new = recent_shares.insert( fc::city_hash64( (char*)&msg.header, sizeof(msg.header)) ).second;
-                      if( !is_new ) continue;
-                      
-                      bool valid = server_ok && verify_share( msg.header );
-                      
-                      increment_share_count( msg.ptsaddr, valid );
-                      
-                      auto itr = user_database.find(msg.ptsaddr);
-
-                      if( itr.valid() )
+                      con.sock->read( packet.data(), packet.size() );
+                      if( !packet.decode( msg ) )
                       {
-                         con.user = itr.value();
+                          wlog( "malformed work frame from ${ep}", ("ep", std::string(ep)) );
+                          continue;
                       }
-                      else
-                      {
-                          elog( "unable to find user in DB" );
-                      }
-
-                      send_work( con, current_work );
+                      
+                      if( !is_new_share( msg.header ) ) continue;
+                      
+                      result.key   = msg.ptsaddr;
+                      result.valid = server_ok && verify_share( shard, msg.header );
+                      result.from  = ep;
+                      // the accounting stage is behind, hold this miner back until it catches up
+                      while( !shard.results.push( result ) )
+                          fc::usleep( fc::microseconds(1000) );
+
+                      send_work( shard, con );
                   }
               } 
               catch ( const fc::exception& e )
               {
-                   connections.erase( con.sock->get_socket().remote_endpoint() );
+                   // a broadcast may still write con.frame, closing ends that write
+                   try { con.sock->close(); } catch ( const fc::exception& ) {}
+                   while( con.writing ) fc::usleep( fc::microseconds(1000) );
+                   shard.connections.erase( ep );
+                   --connection_count;
               }
           }
 
-          bool verify_share( const bitcoin::work& header )
+          bool verify_share( connection_shard& shard, const bitcoin::work& header )
           {
-              if( header.prev != current_work.prev ) 
+              if( header.prev != shard.current_work.prev ) 
               {
                  ++stale;
                  return false;
               }
-             
-              auto result = Hash( (char*)&header, 88 );
-              std::reverse((char*)&result, ((char*)&result) + sizeof(result) );
 
-              if( (((unsigned char*)&result)[0] < 0x3f )  )
+              share_job_ptr job = std::make_shared<share_job>();
+              job->header = header;
+              job->done   = fc::promise<void>::ptr( new fc::promise<void>( "verify_share" ) );
+              shard.pending_shares.push_back( job );
+              if( !shard.verifying )
               {
-                  auto mid = Hash( (char*)&header, 80 );
-                  if( momentum_verify( mid, header.birthday_a, header.birthday_b ) )
+                 shard.verifying = true;
+                 fc::async( [=,&shard](){ verify_pending( shard ); } );
+              }
+              fc::future<void>( job->done ).wait();
+
+              if( job->meets_share_target && job->valid )
+              {
+                 all_shares++;
+                 if( job->meets_block_target )
+                 {
+                    submit_work( header );
+                 }
+                 return true;
+              }
+              return false;
+          }
+
+          /**
+           *  Verifies every share queued on shard, its connections keep reading
+           *  and queueing while a batch is on the verify threads so the next
+           *  batch picks up everything that arrived in the meantime.
+           */
+          void verify_pending( connection_shard& shard )
+          {
+              const uint32_t min_per_thread = 16;
+              while( !shard.pending_shares.empty() )
+              {
+                  // the verify threads hold the batch too, it outlives a canceled wait here
+                  std::shared_ptr<share_batch> batch = std::make_shared<share_batch>();
+                  batch->swap( shard.pending_shares );
+
+                  const uint32_t count   = batch->size();
+                  const uint32_t threads = std::max<uint32_t>( 1, std::min<uint32_t>( verify_threads.size(),
+                                                                   count / min_per_thread ) );
+                  const uint32_t start   = next_verify_thread.fetch_add( threads );
+                  try
                   {
-                     all_shares++;
-                     if( (((uint8_t*)&result)[0] == 0x00 )   &&
-                         (((uint8_t*)&result)[1] == 0x00 ) )  
+                     std::vector< fc::future<void> > done;
+                     for( uint32_t t = 0; t < threads; ++t )
                      {
-                        submit_work( header );
+                        const uint32_t first = uint64_t(count) * t / threads;
+                        const uint32_t last  = uint64_t(count) * (t+1) / threads;
+                        fc::thread&    verify = *verify_threads[ (start + t) % verify_threads.size() ];
+                        done.push_back( verify.async( [=](){ verify_jobs( batch->data() + first, last - first ); } ) );
                      }
-                     return true;
+                     for( uint32_t t = 0; t < done.size(); ++t )
+                        done[t].wait();
+                  }
+                  catch ( const fc::exception& e )
+                  {
+                     elog( "share verification failed ${e}", ("e", e.to_detail_string() ) );
                   }
+                  for( uint32_t i = 0; i < count; ++i )
+                     (*batch)[i]->done->set_value();
               }
-              return false;
+              shard.verifying = false;
           }
 
-          void accept_connection( const stcp_socket_ptr& s )
+          /** runs on shard's thread, which owns the connection from then on */
+          void accept_connection( connection_shard& shard, const stcp_socket_ptr& s )
           {
              try 
              {
                 // init DH handshake, TODO: this could yield.. what happens if we exit here before
                 // adding s to connections list.
                 s->accept();
-                ilog( "accepted connection from ${ep}", 
-                      ("ep", std::string(s->get_socket().remote_endpoint()) ) );
+                fc::ip::endpoint ep = s->get_socket().remote_endpoint();
+                ilog( "accepted connection from ${ep}", ("ep", std::string(ep) ) );
                 
-                connections[s->get_socket().remote_endpoint()].sock = s;
-                fc::async( [=](){ process_connection( connections[s->get_socket().remote_endpoint()] ); } );
+                shard.connections[ep].sock = s;
+                ++connection_count;
+                fc::async( [=,&shard](){ process_connection( shard, ep ); } );
              } 
              catch ( const fc::canceled_exception& e )
              {
@@ -483,8 +904,9 @@ class server
                    stcp_socket_ptr sock = std::make_shared<stcp_socket>();
                    tcp_serv.accept( sock->get_socket() );
 
-                   // do the acceptance process async
-                   fc::async( [=](){ accept_connection( sock ); } );
+                   // do the acceptance process async, connections go round robin to the network threads
+                   connection_shard& shard = *shards[ next_shard++ % shards.size() ];
+                   shard.thread->async( [=,&shard](){ accept_connection( shard, sock ); } );
 
                    fc::usleep(fc::microseconds(1000) );
                 }
@@ -526,6 +948,8 @@ int main( int argc, char** argv )
     serv.conf = fc::json::from_file<config>( argv[1] );
 
     serv.tcp_serv.listen( serv.conf.port );
+    serv.start_verify_threads();
+    serv.start_network_threads();
 
     serv.load_database();
 
@@ -542,6 +966,7 @@ int main( int argc, char** argv )
       wlog( "done with payments\n" );
       return 0;
     }
+    serv.accounting_complete  = fc::async( [&](){ serv.accounting_loop(); } );
     serv.accept_loop_complete = fc::async( [&](){ serv.accept_loop(); } );
     serv.accept_loop_complete.wait();
 
@@ -0,0 +1,42 @@
+#include "sha512_lanes_impl.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace {
+
+struct avx2_vec
+{
+   typedef __m256i type;
+   enum { lanes = 4 };
+
+   static type set1( uint64_t v )          { return _mm256_set1_epi64x( v ); }
+   static type load( const uint64_t* p )   { return _mm256_loadu_si256( (const __m256i*)p ); }
+   static void store( uint64_t* p, type v ){ _mm256_storeu_si256( (__m256i*)p, v ); }
+   static type add( type a, type b )       { return _mm256_add_epi64( a, b ); }
+   static type xor_( type a, type b )      { return _mm256_xor_si256( a, b ); }
+   static type and_( type a, type b )      { return _mm256_and_si256( a, b ); }
+   static type or_( type a, type b )       { return _mm256_or_si256( a, b ); }
+   static type andnot( type a, type b )    { return _mm256_andnot_si256( a, b ); }
+   template<int n> static type shr( type v ){ return _mm256_srli_epi64( v, n ); }
+   template<int n> static type ror( type v ){ return _mm256_or_si256( _mm256_srli_epi64( v, n ), _mm256_slli_epi64( v, 64-n ) ); }
+};
+
+void hash_avx2( const birthday_midstate& ms, const uint32_t* nonces, uint64_t* out )
+{
+   sha512_lanes_run<avx2_vec>( ms, nonces, out );
+}
+
+} // anonymous namespace
+
+const birthday_hasher* sha512_avx2_kernel()
+{
+   static const birthday_hasher hasher = { "avx2", avx2_vec::lanes, &hash_avx2 };
+   return &hasher;
+}
+
+#else
+
+const birthday_hasher* sha512_avx2_kernel() { return nullptr; }
+
+#endif
@@ -0,0 +1,42 @@
+#include "sha512_lanes_impl.hpp"
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+
+namespace {
+
+struct avx512_vec
+{
+   typedef __m512i type;
+   enum { lanes = 8 };
+
+   static type set1( uint64_t v )          { return _mm512_set1_epi64( v ); }
+   static type load( const uint64_t* p )   { return _mm512_loadu_si512( (const void*)p ); }
+   static void store( uint64_t* p, type v ){ _mm512_storeu_si512( (void*)p, v ); }
+   static type add( type a, type b )       { return _mm512_add_epi64( a, b ); }
+   static type xor_( type a, type b )      { return _mm512_xor_si512( a, b ); }
+   static type and_( type a, type b )      { return _mm512_and_si512( a, b ); }
+   static type or_( type a, type b )       { return _mm512_or_si512( a, b ); }
+   static type andnot( type a, type b )    { return _mm512_andnot_si512( a, b ); }
+   template<int n> static type shr( type v ){ return _mm512_srli_epi64( v, n ); }
+   template<int n> static type ror( type v ){ return _mm512_ror_epi64( v, n ); }
+};
+
+void hash_avx512( const birthday_midstate& ms, const uint32_t* nonces, uint64_t* out )
+{
+   sha512_lanes_run<avx512_vec>( ms, nonces, out );
+}
+
+} // anonymous namespace
+
+const birthday_hasher* sha512_avx512_kernel()
+{
+   static const birthday_hasher hasher = { "avx512", avx512_vec::lanes, &hash_avx512 };
+   return &hasher;
+}
+
+#else
+
+const birthday_hasher* sha512_avx512_kernel() { return nullptr; }
+
+#endif
@@ -0,0 +1,217 @@
+#include "sha512_lanes_impl.hpp"
+extern "C" {
+#include "sphlib-3.0/c/sph_sha2.h"
+}
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#define MOMENTUM_GNUC_CPUID
+#endif
+
+namespace {
+
+inline uint64_t ror64( uint64_t v, int n ) { return (v >> n) | (v << (64-n)); }
+inline uint64_t s0( uint64_t x )  { return ror64(x,1)  ^ ror64(x,8)  ^ (x >> 7); }
+inline uint64_t s1( uint64_t x )  { return ror64(x,19) ^ ror64(x,61) ^ (x >> 6); }
+inline uint64_t bs0( uint64_t x ) { return ror64(x,28) ^ ror64(x,34) ^ ror64(x,39); }
+inline uint64_t bs1( uint64_t x ) { return ror64(x,14) ^ ror64(x,18) ^ ror64(x,41); }
+
+struct scalar_vec
+{
+   typedef uint64_t type;
+   enum { lanes = 1 };
+
+   static type set1( uint64_t v )          { return v; }
+   static type load( const uint64_t* p )   { return *p; }
+   static void store( uint64_t* p, type v ){ *p = v; }
+   static type add( type a, type b )       { return a + b; }
+   static type xor_( type a, type b )      { return a ^ b; }
+   static type and_( type a, type b )      { return a & b; }
+   static type or_( type a, type b )       { return a | b; }
+   static type andnot( type a, type b )    { return ~a & b; }
+   template<int n> static type shr( type v ){ return v >> n; }
+   template<int n> static type ror( type v ){ return ror64( v, n ); }
+};
+
+void hash_scalar( const birthday_midstate& ms, const uint32_t* nonces, uint64_t* out )
+{
+   sha512_lanes_run<scalar_vec>( ms, nonces, out );
+}
+
+/** the generic streaming sha512, kept as a reference for the specialized kernels */
+void hash_sphlib( const birthday_midstate& ms, const uint32_t* nonces, uint64_t* out )
+{
+   sph_sha512_context context;
+   sph_sha512_init( &context );
+   sph_sha512( &context, (const char*)nonces, sizeof(*nonces) );
+   sph_sha512( &context, ms.head, sizeof(ms.head) );
+   sph_sha512_close( &context, (char*)out );
+}
+
+struct cpu_features
+{
+   cpu_features():sse2(false),avx2(false),avx512f(false)
+   {
+      uint32_t r1[4] = {0,0,0,0};
+      uint32_t r7[4] = {0,0,0,0};
+      if( !cpuid( 0, r1 ) ) return;
+      const uint32_t max_leaf = r1[0];
+      cpuid( 1, r1 );
+      if( max_leaf >= 7 ) cpuid( 7, r7 );
+
+      sse2 = (r1[3] >> 26) & 1;
+
+      // the os must save the ymm/zmm registers on context switch before the
+      // avx flags reported by cpuid can be trusted
+      const bool osxsave = (r1[2] >> 27) & 1;
+      const bool avx     = (r1[2] >> 28) & 1;
+      if( !osxsave || !avx ) return;
+      const uint64_t xcr0 = xgetbv();
+      if( (xcr0 & 0x06) != 0x06 ) return;
+      avx2 = (r7[1] >> 5) & 1;
+      if( (xcr0 & 0xe6) != 0xe6 ) return;
+      avx512f = (r7[1] >> 16) & 1;
+   }
+
+   static bool cpuid( uint32_t leaf, uint32_t r[4] )
+   {
+#if defined(_MSC_VER)
+      __cpuidex( (int*)r, leaf, 0 );
+      return true;
+#elif defined(MOMENTUM_GNUC_CPUID)
+      return __get_cpuid_count( leaf, 0, &r[0], &r[1], &r[2], &r[3] ) != 0;
+#else
+      return false;
+#endif
+   }
+
+   static uint64_t xgetbv()
+   {
+#if defined(_MSC_VER) && _MSC_FULL_VER >= 160040219
+      return _xgetbv( 0 );
+#elif defined(MOMENTUM_GNUC_CPUID)
+      uint32_t eax, edx;
+      __asm__ __volatile__( ".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0) );
+      return (uint64_t(edx) << 32) | eax;
+#else
+      return 0;
+#endif
+   }
+
+   bool sse2;
+   bool avx2;
+   bool avx512f;
+};
+
+const cpu_features& get_cpu_features()
+{
+   static cpu_features features;
+   return features;
+}
+
+} // anonymous namespace
+
+birthday_midstate::birthday_midstate( const char* h )
+{
+   memcpy( head, h, sizeof(head) );
+
+   uint64_t w[16];
+   memset( w, 0, sizeof(w) );
+   w[0]  = sha512_be32( head );
+   w[1]  = sha512_be64( head + 4 );
+   w[2]  = sha512_be64( head + 12 );
+   w[3]  = sha512_be64( head + 20 );
+   w[4]  = (uint64_t(sha512_be32( head + 28 )) << 32) | 0x80000000ull;
+   w[15] = 36*8;
+   w0    = w[0];
+
+   kw[0] = 0;
+   for( int t = 1; t < 16; ++t )
+      kw[t] = sha512_k[t] + w[t];
+
+   // w[16+i] = s1(w[14+i]) + w[9+i] + s0(w[1+i]) + w[i], keep every term that
+   // is already known, sha512_lanes_run adds the ones that depend on w[0]
+   uint64_t w17 = s1(w[15]) + w[10] + s0(w[2]) + w[1];
+   uint64_t w19 = s1(w17)   + w[12] + s0(w[4]) + w[3];
+   uint64_t w21 = s1(w19)   + w[14] + s0(w[6]) + w[5];
+   pre[0]  = s1(w[14]) + w[9] + s0(w[1]);
+   pre[1]  = w17;
+   pre[2]  = w[11] + s0(w[3]) + w[2];
+   pre[3]  = w19;
+   pre[4]  = w[13] + s0(w[5]) + w[4];
+   pre[5]  = w21;
+   pre[6]  = w[15] + s0(w[7]) + w[6];
+   pre[7]  = s0(w[8]) + w[7];
+   pre[8]  = w17 + s0(w[9]) + w[8];
+   pre[9]  = 0;                          // s0(w[10]) + w[9]
+   pre[10] = w19 + s0(w[11]) + w[10];
+   pre[11] = 0;                          // s0(w[12]) + w[11]
+   pre[12] = w21 + s0(w[13]) + w[12];
+   pre[13] = 0;                          // s0(w[14]) + w[13]
+   pre[14] = s0(w[15]) + w[14];
+   pre[15] = w[15];
+
+   const uint64_t* iv = sha512_iv;
+   const uint64_t t1  = iv[7] + bs1(iv[4]) + ((iv[4] & iv[5]) ^ (~iv[4] & iv[6])) + sha512_k[0] + w0;
+   const uint64_t t2  = bs0(iv[0]) + ((iv[0] & iv[1]) | ((iv[0] | iv[1]) & iv[2]));
+   a1 = t1 + t2;
+   e1 = iv[3] + t1;
+}
+
+void birthday_hash( const birthday_midstate& ms, uint32_t nonce, uint64_t out[8] )
+{
+   sha512_lanes_run<scalar_vec>( ms, &nonce, out );
+}
+
+const birthday_hasher* birthday_hasher_scalar()
+{
+   static const birthday_hasher hasher = { "scalar", 1, &hash_scalar };
+   return &hasher;
+}
+
+const birthday_hasher* birthday_hasher_sphlib()
+{
+   static const birthday_hasher hasher = { "sphlib", 1, &hash_sphlib };
+   return &hasher;
+}
+
+const birthday_hasher* birthday_hasher_sse2()
+{
+   return get_cpu_features().sse2 ? sha512_sse2_kernel() : nullptr;
+}
+
+const birthday_hasher* birthday_hasher_avx2()
+{
+   return get_cpu_features().avx2 ? sha512_avx2_kernel() : nullptr;
+}
+
+const birthday_hasher* birthday_hasher_avx512()
+{
+   return get_cpu_features().avx512f ? sha512_avx512_kernel() : nullptr;
+}
+
+const birthday_hasher* select_birthday_hasher()
+{
+   if( auto h = birthday_hasher_avx512() ) return h;
+   if( auto h = birthday_hasher_avx2() )   return h;
+   if( auto h = birthday_hasher_sse2() )   return h;
+   return birthday_hasher_scalar();
+}
+
+const birthday_hasher* find_birthday_hasher( const char* name )
+{
+   const birthday_hasher* all[] = { birthday_hasher_avx512(), birthday_hasher_avx2(),
+                                    birthday_hasher_sse2(),   birthday_hasher_scalar(),
+                                    birthday_hasher_sphlib() };
+   for( uint32_t i = 0; i < sizeof(all)/sizeof(all[0]); ++i )
+      if( all[i] && strcmp( all[i]->name, name ) == 0 ) return all[i];
+   return nullptr;
+}
+
+const birthday_hasher*& get_birthday_hasher()
+{
+   static const birthday_hasher* hasher = select_birthday_hasher();
+   return hasher;
+}
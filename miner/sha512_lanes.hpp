@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+
+#define MAX_HASH_LANES 8
+
+/**
+ *  Everything about SHA512( nonce || head ) that only depends on the 32 byte
+ *  head, computed once per momentum_search or momentum_verify.  The message
+ *  always fits a single block whose padding and length words are fixed.
+ */
+struct birthday_midstate
+{
+   birthday_midstate( const char* head );
+
+   char     head[32];
+   uint64_t w0;        ///< low half of message word 0, the top half is the nonce
+   uint64_t kw[16];    ///< K[t]+W[t] for rounds 1-15
+   uint64_t pre[16];   ///< the head only terms of schedule words 16-31
+   uint64_t a1;        ///< a and e after round 0, less the nonce
+   uint64_t e1;
+};
+
+/**
+ *  Single nonce version of the specialized hash for the verify path.
+ *
+ *  @param nonce  a multiple of BIRTHDAYS_PER_HASH
+ *  @param out    the 64 byte digest
+ */
+void birthday_hash( const birthday_midstate& ms, uint32_t nonce, uint64_t out[8] );
+
+/**
+ *  A birthday hasher computes SHA512( nonce || head ) for the fixed 36 byte
+ *  momentum message, @ref lanes nonces at a time.
+ *
+ *  @param nonces lanes nonces, each a multiple of BIRTHDAYS_PER_HASH
+ *  @param out    lanes*8 words, the raw digest of nonces[l] at out+l*8 laid
+ *                out exactly as sph_sha512_close would write it
+ */
+struct birthday_hasher
+{
+   const char* name;
+   uint32_t    lanes;
+   void        (*hash)( const birthday_midstate& ms, const uint32_t* nonces, uint64_t* out );
+};
+
+/** portable backends, always available */
+const birthday_hasher* birthday_hasher_scalar();
+const birthday_hasher* birthday_hasher_sphlib();
+
+/** @return nullptr when not compiled in or not supported by this cpu */
+const birthday_hasher* birthday_hasher_sse2();
+const birthday_hasher* birthday_hasher_avx2();
+const birthday_hasher* birthday_hasher_avx512();
+
+/** @return the widest backend supported by this cpu */
+const birthday_hasher* select_birthday_hasher();
+
+/** @return nullptr if no backend by that name is available */
+const birthday_hasher* find_birthday_hasher( const char* name );
+
+/**
+ *  The backend used by momentum_search, defaults to select_birthday_hasher()
+ */
+const birthday_hasher*& get_birthday_hasher();
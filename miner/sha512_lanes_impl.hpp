@@ -0,0 +1,194 @@
+#pragma once
+/**
+ *  Shared body of the multi-lane SHA512 kernels.  Each sha512_*.cpp file is
+ *  compiled with its own instruction set flags and instantiates
+ *  sha512_lanes_run<> with a vector type from that instruction set, so only
+ *  plain C headers may be included from here.
+ */
+#include "sha512_lanes.hpp"
+#include <string.h>
+
+/** kernels compiled into this binary, nullptr when the compiler lacks the isa */
+const birthday_hasher* sha512_sse2_kernel();
+const birthday_hasher* sha512_avx2_kernel();
+const birthday_hasher* sha512_avx512_kernel();
+
+namespace {
+
+const uint64_t sha512_k[80] = {
+   0x428A2F98D728AE22ull, 0x7137449123EF65CDull, 0xB5C0FBCFEC4D3B2Full, 0xE9B5DBA58189DBBCull,
+   0x3956C25BF348B538ull, 0x59F111F1B605D019ull, 0x923F82A4AF194F9Bull, 0xAB1C5ED5DA6D8118ull,
+   0xD807AA98A3030242ull, 0x12835B0145706FBEull, 0x243185BE4EE4B28Cull, 0x550C7DC3D5FFB4E2ull,
+   0x72BE5D74F27B896Full, 0x80DEB1FE3B1696B1ull, 0x9BDC06A725C71235ull, 0xC19BF174CF692694ull,
+   0xE49B69C19EF14AD2ull, 0xEFBE4786384F25E3ull, 0x0FC19DC68B8CD5B5ull, 0x240CA1CC77AC9C65ull,
+   0x2DE92C6F592B0275ull, 0x4A7484AA6EA6E483ull, 0x5CB0A9DCBD41FBD4ull, 0x76F988DA831153B5ull,
+   0x983E5152EE66DFABull, 0xA831C66D2DB43210ull, 0xB00327C898FB213Full, 0xBF597FC7BEEF0EE4ull,
+   0xC6E00BF33DA88FC2ull, 0xD5A79147930AA725ull, 0x06CA6351E003826Full, 0x142929670A0E6E70ull,
+   0x27B70A8546D22FFCull, 0x2E1B21385C26C926ull, 0x4D2C6DFC5AC42AEDull, 0x53380D139D95B3DFull,
+   0x650A73548BAF63DEull, 0x766A0ABB3C77B2A8ull, 0x81C2C92E47EDAEE6ull, 0x92722C851482353Bull,
+   0xA2BFE8A14CF10364ull, 0xA81A664BBC423001ull, 0xC24B8B70D0F89791ull, 0xC76C51A30654BE30ull,
+   0xD192E819D6EF5218ull, 0xD69906245565A910ull, 0xF40E35855771202Aull, 0x106AA07032BBD1B8ull,
+   0x19A4C116B8D2D0C8ull, 0x1E376C085141AB53ull, 0x2748774CDF8EEB99ull, 0x34B0BCB5E19B48A8ull,
+   0x391C0CB3C5C95A63ull, 0x4ED8AA4AE3418ACBull, 0x5B9CCA4F7763E373ull, 0x682E6FF3D6B2B8A3ull,
+   0x748F82EE5DEFB2FCull, 0x78A5636F43172F60ull, 0x84C87814A1F0AB72ull, 0x8CC702081A6439ECull,
+   0x90BEFFFA23631E28ull, 0xA4506CEBDE82BDE9ull, 0xBEF9A3F7B2C67915ull, 0xC67178F2E372532Bull,
+   0xCA273ECEEA26619Cull, 0xD186B8C721C0C207ull, 0xEADA7DD6CDE0EB1Eull, 0xF57D4F7FEE6ED178ull,
+   0x06F067AA72176FBAull, 0x0A637DC5A2C898A6ull, 0x113F9804BEF90DAEull, 0x1B710B35131C471Bull,
+   0x28DB77F523047D84ull, 0x32CAAB7B40C72493ull, 0x3C9EBE0A15C9BEBCull, 0x431D67C49C100D4Cull,
+   0x4CC5D4BECB3E42B6ull, 0x597F299CFC657E2Aull, 0x5FCB6FAB3AD6FAECull, 0x6C44198C4A475817ull
+};
+
+const uint64_t sha512_iv[8] = {
+   0x6A09E667F3BCC908ull, 0xBB67AE8584CAA73Bull, 0x3C6EF372FE94F82Bull, 0xA54FF53A5F1D36F1ull,
+   0x510E527FADE682D1ull, 0x9B05688C2B3E6C1Full, 0x1F83D9ABFB41BD6Bull, 0x5BE0CD19137E2179ull
+};
+
+inline uint32_t sha512_be32( const char* p )
+{
+   const unsigned char* b = (const unsigned char*)p;
+   return (uint32_t(b[0])<<24) | (uint32_t(b[1])<<16) | (uint32_t(b[2])<<8) | uint32_t(b[3]);
+}
+
+inline uint64_t sha512_be64( const char* p )
+{
+   return (uint64_t(sha512_be32(p)) << 32) | sha512_be32(p+4);
+}
+
+inline uint32_t sha512_bswap32( uint32_t v )
+{
+   return (v>>24) | ((v>>8)&0xff00) | ((v<<8)&0xff0000) | (v<<24);
+}
+
+/** writes v big endian, the byte order sph_sha512_close uses for the digest */
+inline void sha512_store_be64( char* p, uint64_t v )
+{
+   unsigned char* b = (unsigned char*)p;
+   b[0] = (unsigned char)(v >> 56); b[1] = (unsigned char)(v >> 48);
+   b[2] = (unsigned char)(v >> 40); b[3] = (unsigned char)(v >> 32);
+   b[4] = (unsigned char)(v >> 24); b[5] = (unsigned char)(v >> 16);
+   b[6] = (unsigned char)(v >> 8);  b[7] = (unsigned char)v;
+}
+
+/** top half of message word 0 for a nonce stored in host (little endian) order */
+inline uint64_t sha512_nonce_word( uint32_t nonce )
+{
+   return uint64_t(sha512_bswap32(nonce)) << 32;
+}
+
+/**
+ *  V must provide a vector type V::type of V::lanes 64 bit lanes and
+ *  set1, load, store, add, xor_, and_, or_, andnot (~a & b), shr<n> and ror<n>.
+ */
+template<typename V>
+struct sha512_ops
+{
+   typedef typename V::type vec;
+
+   static vec s0( vec x )  { return V::xor_( V::xor_( V::template ror<1>(x),  V::template ror<8>(x) ),  V::template shr<7>(x) ); }
+   static vec s1( vec x )  { return V::xor_( V::xor_( V::template ror<19>(x), V::template ror<61>(x) ), V::template shr<6>(x) ); }
+   static vec bs0( vec x ) { return V::xor_( V::xor_( V::template ror<28>(x), V::template ror<34>(x) ), V::template ror<39>(x) ); }
+   static vec bs1( vec x ) { return V::xor_( V::xor_( V::template ror<14>(x), V::template ror<18>(x) ), V::template ror<41>(x) ); }
+
+   static vec ch( vec e, vec f, vec g )  { return V::xor_( V::and_( e, f ), V::andnot( e, g ) ); }
+   static vec maj( vec a, vec b, vec c ) { return V::or_( V::and_( a, b ), V::and_( V::or_( a, b ), c ) ); }
+
+   /** K[t]+W[t], extending the schedule kept in w[t&15] once t reaches 32 */
+   static vec kw( const birthday_midstate& ms, vec* w, int t )
+   {
+      // rounds 1-15 use fixed message words, K[t]+W[t] is part of the midstate
+      if( t < 16 ) return V::set1( ms.kw[t] );
+      if( t >= 32 )
+         w[t&15] = V::add( V::add( s1(w[(t-2)&15]), w[(t-7)&15] ), V::add( s0(w[(t-15)&15]), w[t&15] ) );
+      return V::add( w[t&15], V::set1( sha512_k[t] ) );
+   }
+
+   /** one round with the names rotated by the caller, only d and h change */
+   static void round( vec a, vec b, vec c, vec& d, vec e, vec f, vec g, vec& h, vec kw )
+   {
+      const vec t1 = V::add( V::add( h, bs1(e) ), V::add( ch( e, f, g ), kw ) );
+      d = V::add( d, t1 );
+      h = V::add( t1, V::add( bs0(a), maj( a, b, c ) ) );
+   }
+};
+
+/**
+ *  Hashes V::lanes nonces against a prepared midstate.  Round 0 and the
+ *  head-only parts of schedule words 16-31 come from the midstate, words
+ *  5-14 of the block are always zero and are left out entirely.
+ */
+template<typename V>
+inline void sha512_lanes_run( const birthday_midstate& ms, const uint32_t* nonces, uint64_t* out )
+{
+   typedef sha512_ops<V>    op;
+   typedef typename V::type vec;
+
+   uint64_t first[V::lanes];
+   for( uint32_t l = 0; l < V::lanes; ++l )
+      first[l] = sha512_nonce_word( nonces[l] );
+   const vec nw = V::load( first );
+
+   // w[t] for t = 16..79 lives in w[t&15], words 0-15 are never needed again
+   vec w[16];
+   const vec w0 = V::or_( nw, V::set1( ms.w0 ) );
+   w[0]  = V::add( w0, V::set1( ms.pre[0] ) );
+   w[1]  = V::set1( ms.pre[1] );
+   w[2]  = V::add( op::s1(w[0]), V::set1( ms.pre[2] ) );
+   w[3]  = V::set1( ms.pre[3] );
+   w[4]  = V::add( op::s1(w[2]), V::set1( ms.pre[4] ) );
+   w[5]  = V::set1( ms.pre[5] );
+   w[6]  = V::add( op::s1(w[4]), V::set1( ms.pre[6] ) );
+   w[7]  = V::add( V::add( op::s1(w[5]), w[0] ), V::set1( ms.pre[7] ) );
+   w[8]  = V::add( op::s1(w[6]), V::set1( ms.pre[8] ) );
+   w[9]  = V::add( op::s1(w[7]), w[2] );
+   w[10] = V::add( op::s1(w[8]), V::set1( ms.pre[10] ) );
+   w[11] = V::add( op::s1(w[9]), w[4] );
+   w[12] = V::add( op::s1(w[10]), V::set1( ms.pre[12] ) );
+   w[13] = V::add( op::s1(w[11]), w[6] );
+   w[14] = V::add( V::add( op::s1(w[12]), w[7] ), V::set1( ms.pre[14] ) );
+   w[15] = V::add( V::add( op::s1(w[13]), w[8] ), V::add( op::s0(w[0]), V::set1( ms.pre[15] ) ) );
+
+   // state after round 0, which only depends on the nonce through w[0]
+   vec a = V::add( nw, V::set1( ms.a1 ) ), b = V::set1( sha512_iv[0] );
+   vec c = V::set1( sha512_iv[1] ),        d = V::set1( sha512_iv[2] );
+   vec e = V::add( nw, V::set1( ms.e1 ) ), f = V::set1( sha512_iv[4] );
+   vec g = V::set1( sha512_iv[5] ),        h = V::set1( sha512_iv[6] );
+
+   // seven rounds with explicit renaming bring t to a multiple of 8, the rest
+   // are unrolled by eight so the names rotate back into place
+   for( int t = 1; t < 8; ++t )
+   {
+      const vec t1 = V::add( V::add( h, op::bs1(e) ), V::add( op::ch( e, f, g ), V::set1( ms.kw[t] ) ) );
+      const vec t2 = V::add( op::bs0(a), op::maj( a, b, c ) );
+      h = g; g = f; f = e;
+      e = V::add( d, t1 );
+      d = c; c = b; b = a;
+      a = V::add( t1, t2 );
+   }
+   for( int t = 8; t < 80; t += 8 )
+   {
+      op::round( a, b, c, d, e, f, g, h, op::kw( ms, w, t ) );
+      op::round( h, a, b, c, d, e, f, g, op::kw( ms, w, t+1 ) );
+      op::round( g, h, a, b, c, d, e, f, op::kw( ms, w, t+2 ) );
+      op::round( f, g, h, a, b, c, d, e, op::kw( ms, w, t+3 ) );
+      op::round( e, f, g, h, a, b, c, d, op::kw( ms, w, t+4 ) );
+      op::round( d, e, f, g, h, a, b, c, op::kw( ms, w, t+5 ) );
+      op::round( c, d, e, f, g, h, a, b, op::kw( ms, w, t+6 ) );
+      op::round( b, c, d, e, f, g, h, a, op::kw( ms, w, t+7 ) );
+   }
+
+   uint64_t state[8][V::lanes];
+   V::store( state[0], V::add( a, V::set1( sha512_iv[0] ) ) );
+   V::store( state[1], V::add( b, V::set1( sha512_iv[1] ) ) );
+   V::store( state[2], V::add( c, V::set1( sha512_iv[2] ) ) );
+   V::store( state[3], V::add( d, V::set1( sha512_iv[3] ) ) );
+   V::store( state[4], V::add( e, V::set1( sha512_iv[4] ) ) );
+   V::store( state[5], V::add( f, V::set1( sha512_iv[5] ) ) );
+   V::store( state[6], V::add( g, V::set1( sha512_iv[6] ) ) );
+   V::store( state[7], V::add( h, V::set1( sha512_iv[7] ) ) );
+
+   for( uint32_t l = 0; l < V::lanes; ++l )
+      for( uint32_t x = 0; x < 8; ++x )
+         sha512_store_be64( (char*)&out[l*8+x], state[x][l] );
+}
+
+} // anonymous namespace
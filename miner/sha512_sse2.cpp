@@ -0,0 +1,42 @@
+#include "sha512_lanes_impl.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+namespace {
+
+struct sse2_vec
+{
+   typedef __m128i type;
+   enum { lanes = 2 };
+
+   static type set1( uint64_t v )          { return _mm_set1_epi64x( v ); }
+   static type load( const uint64_t* p )   { return _mm_loadu_si128( (const __m128i*)p ); }
+   static void store( uint64_t* p, type v ){ _mm_storeu_si128( (__m128i*)p, v ); }
+   static type add( type a, type b )       { return _mm_add_epi64( a, b ); }
+   static type xor_( type a, type b )      { return _mm_xor_si128( a, b ); }
+   static type and_( type a, type b )      { return _mm_and_si128( a, b ); }
+   static type or_( type a, type b )       { return _mm_or_si128( a, b ); }
+   static type andnot( type a, type b )    { return _mm_andnot_si128( a, b ); }
+   template<int n> static type shr( type v ){ return _mm_srli_epi64( v, n ); }
+   template<int n> static type ror( type v ){ return _mm_or_si128( _mm_srli_epi64( v, n ), _mm_slli_epi64( v, 64-n ) ); }
+};
+
+void hash_sse2( const birthday_midstate& ms, const uint32_t* nonces, uint64_t* out )
+{
+   sha512_lanes_run<sse2_vec>( ms, nonces, out );
+}
+
+} // anonymous namespace
+
+const birthday_hasher* sha512_sse2_kernel()
+{
+   static const birthday_hasher hasher = { "sse2", sse2_vec::lanes, &hash_sse2 };
+   return &hasher;
+}
+
+#else
+
+const birthday_hasher* sha512_sse2_kernel() { return nullptr; }
+
+#endif
@@ -0,0 +1,101 @@
+#pragma once
+#include "user_database.hpp"
+#include <bts/db/level_map.hpp>
+#include <unordered_map>
+#include <string>
+#include <stdint.h>
+
+/**
+ *  In memory front of the user database for the accounting stage.  Share
+ *  counts go to the cached record of each user and only reach the database
+ *  on flush(), where every user that changed is stored once however many
+ *  shares it sent in between.
+ *
+ *  A crash loses at most the shares counted since the last flush.  Payments
+ *  must not be lost that way, so the server writes and flushes the payment
+ *  log line first and then changes the record with record() and writes it
+ *  at once with store().  A crash in between leaves a logged payment to
+ *  reconcile, never a paid balance without its log line.
+ */
+class share_ledger
+{
+   public:
+      typedef bts::db::level_map<std::string,user_record> database;
+
+      enum { MAX_HOT = 1 << 16 };   ///< records kept after a flush, beyond this the cache starts over
+
+      share_ledger( database& db ):db(db),unflushed(0),last_flush( fc::time_point::now() ){}
+
+      /** @return the record of key after counting one share */
+      const user_record& count( const std::string& key, bool valid )
+      {
+         entry& e = load( key );
+         if( valid ) e.record.valid++;
+         else        e.record.invalid++;
+         e.dirty = true;
+         ++unflushed;
+         return e.record;
+      }
+
+      /** @return the current record of key, changes to it are stored by store() */
+      user_record& record( const std::string& key )
+      {
+         return load( key ).record;
+      }
+
+      /** stores the record of key now, for changes that may not wait for a flush */
+      void store( const std::string& key )
+      {
+         entry& e = load( key );
+         db.store( key, e.record );
+         e.dirty = false;
+      }
+
+      /** shares counted since the last flush */
+      uint64_t pending()const { return unflushed; }
+
+      /** @return true once max_shares were counted or max_age passed since the last flush */
+      bool flush_due( uint64_t max_shares, const fc::microseconds& max_age )const
+      {
+         return unflushed && ( unflushed >= max_shares || fc::time_point::now() - last_flush > max_age );
+      }
+
+      void flush()
+      {
+         for( auto itr = hot.begin(); itr != hot.end(); ++itr )
+         {
+            if( !itr->second.dirty ) continue;
+            db.store( itr->first, itr->second.record );
+            itr->second.dirty = false;
+         }
+         if( hot.size() > MAX_HOT ) hot.clear();
+         unflushed  = 0;
+         last_flush = fc::time_point::now();
+      }
+
+   private:
+      struct entry
+      {
+         entry():dirty(false){}
+
+         user_record record;
+         bool        dirty;
+      };
+
+      entry& load( const std::string& key )
+      {
+         auto itr = hot.find( key );
+         if( itr != hot.end() ) return itr->second;
+
+         entry& e = hot[key];
+         auto found = db.find( key );
+         // a new user starts from the empty record
+         if( found.valid() ) e.record = found.value();
+         return e;
+      }
+
+      database&                              db;
+      std::unordered_map<std::string,entry>  hot;
+      uint64_t                               unflushed;
+      fc::time_point                         last_flush;
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+/**
+ *  Bounded ring with one producer thread and one consumer thread.  Neither
+ *  side locks, each only writes its own index and reads the other one with
+ *  acquire, which makes the slot written before a release visible.
+ */
+template<typename T>
+class spsc_queue
+{
+   public:
+      /** @param capacity rounded up to a power of two */
+      explicit spsc_queue( uint32_t capacity ):head(0),tail(0)
+      {
+         uint32_t size = 1;
+         while( size < capacity ) size <<= 1;
+         slots.resize( size );
+         mask = size - 1;
+      }
+
+      /** producer only, @return false if the queue is full */
+      bool push( const T& value )
+      {
+         const uint32_t t = tail.load( std::memory_order_relaxed );
+         if( t - head.load( std::memory_order_acquire ) > mask ) return false;
+         slots[t & mask] = value;
+         tail.store( t + 1, std::memory_order_release );
+         return true;
+      }
+
+      /**
+       *  consumer only, @return false if the queue is empty.  value is copy
+       *  assigned so that the slot and value both keep whatever they own,
+       *  a reused value and ring of strings stop allocating once warm.
+       */
+      bool pop( T& value )
+      {
+         const uint32_t h = head.load( std::memory_order_relaxed );
+         if( h == tail.load( std::memory_order_acquire ) ) return false;
+         value = slots[h & mask];
+         head.store( h + 1, std::memory_order_release );
+         return true;
+      }
+
+      bool empty()const
+      {
+         return head.load( std::memory_order_acquire ) == tail.load( std::memory_order_acquire );
+      }
+
+   private:
+      spsc_queue( const spsc_queue& );
+      spsc_queue& operator=( const spsc_queue& );
+
+      std::vector<T>        slots;
+      uint32_t              mask;
+      char                  before[64];
+      std::atomic<uint32_t> head;   ///< next slot to pop, written by the consumer
+      char                  between[64];
+      std::atomic<uint32_t> tail;   ///< next slot to push, written by the producer
+      char                  after[64];
+};
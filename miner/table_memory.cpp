@@ -0,0 +1,264 @@
+#include "table_memory.hpp"
+#include <iostream>
+#include <new>
+#include <algorithm>
+#include <fstream>
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#elif defined(_WIN32)
+#include <malloc.h>
+#endif
+
+namespace {
+
+const size_t SMALL_PAGE = 4096;
+
+size_t page_size( table_page_policy pages )
+{
+   switch( pages )
+   {
+      case HUGE_PAGES_1G:          return size_t(1) << 30;
+      case HUGE_PAGES_2M:
+      case TRANSPARENT_HUGE_PAGES: return size_t(2) << 20;
+      case SMALL_PAGES:            break;
+   }
+   return SMALL_PAGE;
+}
+
+size_t round_up( size_t bytes, size_t page )
+{
+   return (bytes + page - 1) & ~(page - 1);
+}
+
+#if defined(__linux__)
+
+/** mmap of a hugetlbfs backed region, nullptr if none are reserved */
+void* map_huge( size_t bytes, int page_shift )
+{
+   void* p = mmap( nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0 );
+   return p == MAP_FAILED ? nullptr : p;
+}
+
+/**
+ *  Anonymous memory aligned to a 2 MB boundary so that every part of it can
+ *  be backed by a transparent huge page, the slack is unmapped again.
+ */
+void* map_aligned( size_t bytes, size_t align )
+{
+   const size_t slack = bytes + align;
+   void* p = mmap( nullptr, slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+   if( p == MAP_FAILED ) return nullptr;
+
+   const uintptr_t start   = (uintptr_t)p;
+   const uintptr_t aligned = (start + align - 1) & ~uintptr_t(align - 1);
+   if( aligned != start )
+      munmap( p, aligned - start );
+   if( aligned + bytes != start + slack )
+      munmap( (void*)(aligned + bytes), start + slack - aligned - bytes );
+   return (void*)aligned;
+}
+
+enum { MAX_NODES = 1024, MASK_BITS = 8*sizeof(unsigned long) };
+
+/**
+ *  Sets the bit of every node in /sys/devices/system/node/online, a list
+ *  such as "0-3,6".  The kernel rejects bits above the nodes it was built
+ *  for, so only nodes that exist may be set.
+ *
+ *  @return the highest node set, -1 if the list cannot be read
+ */
+int online_nodes( unsigned long* mask )
+{
+   std::ifstream in( "/sys/devices/system/node/online" );
+   std::string   list;
+   if( !std::getline( in, list ) ) return -1;
+
+   int highest = -1;
+   const char* c = list.c_str();
+   while( *c >= '0' && *c <= '9' )
+   {
+      char* end;
+      long first = strtol( c, &end, 10 );
+      long last  = first;
+      if( *end == '-' ) last = strtol( end + 1, &end, 10 );
+      if( first < 0 || last >= MAX_NODES || last < first ) return -1;
+      for( long n = first; n <= last; ++n )
+         mask[n / MASK_BITS] |= 1ul << (n % MASK_BITS);
+      highest = std::max<int>( highest, last );
+      c = *end == ',' ? end + 1 : end;
+   }
+   return highest;
+}
+
+/** mbind(2) without a libnuma dependency, MPOL_* values from linux/mempolicy.h */
+bool apply_numa( void* p, size_t bytes, const table_memory_policy& policy )
+{
+#if defined(SYS_mbind)
+   enum { MPOL_BIND_MODE = 2, MPOL_INTERLEAVE_MODE = 3 };
+   unsigned long online[MAX_NODES / MASK_BITS] = {};
+   unsigned long mask[MAX_NODES / MASK_BITS]   = {};
+   const int highest = online_nodes( online );
+   if( highest < 0 ) return false;
+
+   int mode;
+   if( policy.numa == NUMA_INTERLEAVE )
+   {
+      std::copy( online, online + MAX_NODES / MASK_BITS, mask );
+      mode = MPOL_INTERLEAVE_MODE;
+   }
+   else
+   {
+      if( policy.node < 0 || policy.node > highest ) return false;
+      const unsigned long bit = 1ul << (policy.node % MASK_BITS);
+      if( !(online[policy.node / MASK_BITS] & bit) ) return false;
+      mask[policy.node / MASK_BITS] = bit;
+      mode = MPOL_BIND_MODE;
+   }
+   // maxnode counts one past the last bit the kernel reads
+   return syscall( SYS_mbind, p, bytes, mode, mask, (unsigned long)highest + 2, 0u ) == 0;
+#else
+   return false;
+#endif
+}
+
+#endif
+
+} // anonymous namespace
+
+table_memory::table_memory( size_t size, const table_memory_policy& policy ) :
+   base(nullptr),
+   bytes(size),
+   mapped(0),
+   obtained(SMALL_PAGES)
+{
+#if defined(__linux__)
+   for( int pages = policy.pages; !base && pages >= SMALL_PAGES; --pages )
+   {
+      obtained = table_page_policy(pages);
+      mapped   = round_up( size, page_size( obtained ) );
+      switch( obtained )
+      {
+         case HUGE_PAGES_1G:
+            base = map_huge( mapped, 30 );
+            break;
+         case HUGE_PAGES_2M:
+            base = map_huge( mapped, 21 );
+            break;
+         case TRANSPARENT_HUGE_PAGES:
+            base = map_aligned( mapped, page_size( obtained ) );
+            if( base && madvise( base, mapped, MADV_HUGEPAGE ) != 0 )
+               obtained = SMALL_PAGES;
+            break;
+         case SMALL_PAGES:
+            base = map_aligned( mapped, SMALL_PAGE );
+            break;
+      }
+   }
+   if( !base ) throw std::bad_alloc();
+
+   if( policy.numa != NUMA_FIRST_TOUCH && !apply_numa( base, mapped, policy ) )
+      std::cerr<<"table memory: error, numa policy refused ("<<(policy.numa == NUMA_BIND ? "node not online" : "no online nodes")
+               <<" or mbind failed), using first touch placement\n";
+#else
+   mapped = round_up( size, SMALL_PAGE );
+#if defined(_WIN32)
+   base = _aligned_malloc( mapped, SMALL_PAGE );
+#else
+   if( posix_memalign( &base, SMALL_PAGE, mapped ) != 0 ) base = nullptr;
+#endif
+   if( !base ) throw std::bad_alloc();
+#endif
+
+   if( obtained != policy.pages )
+      std::cerr<<"table memory: "<<table_page_policy_name( policy.pages )<<" pages not available, using "
+               <<table_page_policy_name( obtained )<<" pages\n";
+}
+
+table_memory::~table_memory()
+{
+#if defined(__linux__)
+   munmap( base, mapped );
+#elif defined(_WIN32)
+   _aligned_free( base );
+#else
+   free( base );
+#endif
+}
+
+table_memory_policy& get_table_memory_policy()
+{
+   static table_memory_policy policy;
+   return policy;
+}
+
+const char* table_page_policy_name( table_page_policy pages )
+{
+   switch( pages )
+   {
+      case SMALL_PAGES:            return "small";
+      case TRANSPARENT_HUGE_PAGES: return "thp";
+      case HUGE_PAGES_2M:          return "2m";
+      case HUGE_PAGES_1G:          return "1g";
+   }
+   return "unknown";
+}
+
+bool parse_table_page_policy( const std::string& name, table_page_policy& pages )
+{
+   for( int p = SMALL_PAGES; p <= HUGE_PAGES_1G; ++p )
+   {
+      if( name == table_page_policy_name( table_page_policy(p) ) )
+      {
+         pages = table_page_policy(p);
+         return true;
+      }
+   }
+   return false;
+}
+
+bool parse_table_numa_policy( const std::string& name, table_memory_policy& policy )
+{
+   if( name == "first-touch" )
+   {
+      policy.numa = NUMA_FIRST_TOUCH;
+      return true;
+   }
+   if( name == "interleave" )
+   {
+      policy.numa = NUMA_INTERLEAVE;
+      return true;
+   }
+   if( name.empty() || name.find_first_not_of( "0123456789" ) != std::string::npos || name.size() > 4 )
+      return false;
+   policy.numa = NUMA_BIND;
+   policy.node = atoi( name.c_str() );
+   return true;
+}
+
+bool parse_byte_size( const std::string& value, uint64_t& bytes )
+{
+   const size_t digits = std::min( value.find_first_not_of( "0123456789" ), value.size() );
+   if( digits == 0 || digits > 12 || value.size() > digits + 1 ) return false;
+   uint64_t scale = 1;
+   if( digits < value.size() )
+   {
+      switch( value[digits] )
+      {
+         case 'K': case 'k': scale = 1ull << 10; break;
+         case 'M': case 'm': scale = 1ull << 20; break;
+         case 'G': case 'g': scale = 1ull << 30; break;
+         default: return false;
+      }
+   }
+   bytes = strtoull( value.c_str(), nullptr, 10 ) * scale;
+   return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/**
+ *  How the backing store of the big momentum tables is allocated.  Every
+ *  store into the table is a random access, so with 4 KB pages nearly each
+ *  one is also a TLB miss.
+ */
+enum table_page_policy
+{
+   SMALL_PAGES,             ///< plain anonymous memory
+   TRANSPARENT_HUGE_PAGES,  ///< anonymous memory with madvise(MADV_HUGEPAGE)
+   HUGE_PAGES_2M,           ///< hugetlbfs pages, must be reserved by the admin
+   HUGE_PAGES_1G
+};
+
+enum table_numa_policy
+{
+   NUMA_FIRST_TOUCH,        ///< leave placement to the kernel
+   NUMA_INTERLEAVE,         ///< spread pages over every node
+   NUMA_BIND                ///< keep every page on one node
+};
+
+struct table_memory_policy
+{
+   table_memory_policy():pages(TRANSPARENT_HUGE_PAGES),numa(NUMA_FIRST_TOUCH),node(0){}
+
+   table_page_policy pages;
+   table_numa_policy numa;
+   int               node;   ///< for NUMA_BIND
+};
+
+/** the policy used for tables created from now on, set from the command line */
+table_memory_policy& get_table_memory_policy();
+
+const char* table_page_policy_name( table_page_policy pages );
+bool        parse_table_page_policy( const std::string& name, table_page_policy& pages );
+
+/** accepts first-touch, interleave or a node number */
+bool        parse_table_numa_policy( const std::string& name, table_memory_policy& policy );
+
+/** a byte count such as 805306368, 512M or 1G, suffixes are powers of 1024 */
+bool        parse_byte_size( const std::string& value, uint64_t& bytes );
+
+/**
+ *  A page aligned block allocated with the requested policy.  Page sizes
+ *  that cannot be had fall back to the next smaller one down to
+ *  SMALL_PAGES, and a NUMA policy the kernel refuses is skipped, so
+ *  construction only fails when there is no memory at all.
+ *
+ *  The memory is not touched here, so pages are placed by the first thread
+ *  that clears them unless a NUMA policy says otherwise.
+ */
+class table_memory
+{
+   public:
+      table_memory( size_t bytes, const table_memory_policy& policy = get_table_memory_policy() );
+      ~table_memory();
+
+      void*             data()const  { return base; }
+      size_t            size()const  { return bytes; }
+
+      /** the page policy actually obtained */
+      table_page_policy pages()const { return obtained; }
+
+   private:
+      table_memory( const table_memory& );
+      table_memory& operator=( const table_memory& );
+
+      void*             base;
+      size_t            bytes;
+      size_t            mapped;
+      table_page_policy obtained;
+};
@@ -1,6 +1,8 @@
 #pragma once
 #include "user_database.hpp"
 #include "bitcoin.hpp"
+#include <string.h>
+#include <stdint.h>
 
 struct work_message
 {
@@ -27,6 +29,107 @@ enum work_types
    OK
 };
 
+/**
+ *  The 192 byte wire frame of a work_message, read and written in place.
+ *
+ *  The layout is the one fc::raw::pack gives a work_message with an address
+ *  of at most MAX_ADDRESS characters, so peers that still pack and unpack
+ *  with fc read these frames unchanged.  The last byte carries the frame
+ *  version, older senders leave it 0.
+ */
+class work_frame
+{
+   public:
+      enum
+      {
+         SIZE           = 192,
+         VERSION        = 1,
+         TYPE_OFFSET    = 0,
+         HEADER_OFFSET  = 4,
+         NONCE_OFFSET   = HEADER_OFFSET + 76,
+         USER_OFFSET    = HEADER_OFFSET + 88,
+         MATURE_OFFSET  = USER_OFFSET + 32,
+         SHARES_OFFSET  = MATURE_OFFSET + 8,
+         EARNED_OFFSET  = SHARES_OFFSET + 8,
+         SPM_OFFSET     = EARNED_OFFSET + 8,
+         FEE_OFFSET     = SPM_OFFSET + 4,
+         ADDRESS_OFFSET = FEE_OFFSET + 4,     ///< one length byte, then the characters
+         VERSION_OFFSET = SIZE - 1,
+         MAX_ADDRESS    = VERSION_OFFSET - ADDRESS_OFFSET - 1
+      };
+
+      work_frame(){ memset( bytes, 0, sizeof(bytes) ); }
+
+      char*       data()       { return bytes; }
+      const char* data()const  { return bytes; }
+      size_t      size()const  { return sizeof(bytes); }
+
+      /** @return false if the address is longer than MAX_ADDRESS */
+      bool encode( const work_message& msg )
+      {
+         if( msg.ptsaddr.size() > MAX_ADDRESS ) return false;
+         put( TYPE_OFFSET, msg.type );
+         put( HEADER_OFFSET, msg.header );
+         set_user( msg.user );
+         put( MATURE_OFFSET, msg.mature_balance );
+         put( SHARES_OFFSET, msg.pool_shares );
+         put( EARNED_OFFSET, msg.pool_earned );
+         put( SPM_OFFSET, msg.pool_spm );
+         put( FEE_OFFSET, msg.pool_fee );
+         bytes[ADDRESS_OFFSET] = char(msg.ptsaddr.size());
+         memcpy( bytes + ADDRESS_OFFSET + 1, msg.ptsaddr.data(), msg.ptsaddr.size() );
+         memset( bytes + ADDRESS_OFFSET + 1 + msg.ptsaddr.size(), 0, MAX_ADDRESS - msg.ptsaddr.size() );
+         bytes[VERSION_OFFSET] = VERSION;
+         return true;
+      }
+
+      /**
+       *  Assigning the address reuses the capacity of msg.ptsaddr, decoding
+       *  into the same message again does not allocate.
+       *
+       *  @return false for an unknown version or an address that does not fit
+       */
+      bool decode( work_message& msg )const
+      {
+         const uint8_t length = uint8_t(bytes[ADDRESS_OFFSET]);
+         if( uint8_t(bytes[VERSION_OFFSET]) > VERSION || length > MAX_ADDRESS ) return false;
+         get( TYPE_OFFSET, msg.type );
+         get( HEADER_OFFSET, msg.header );
+         get( USER_OFFSET, msg.user.valid );
+         get( USER_OFFSET + 8, msg.user.invalid );
+         get( USER_OFFSET + 16, msg.user.total_earned );
+         get( USER_OFFSET + 24, msg.user.total_paid );
+         get( MATURE_OFFSET, msg.mature_balance );
+         get( SHARES_OFFSET, msg.pool_shares );
+         get( EARNED_OFFSET, msg.pool_earned );
+         get( SPM_OFFSET, msg.pool_spm );
+         get( FEE_OFFSET, msg.pool_fee );
+         msg.ptsaddr.assign( bytes + ADDRESS_OFFSET + 1, length );
+         return true;
+      }
+
+      /** the fields that differ between the frames of one work, patched in place */
+      void set_header( const bitcoin::work& header ) { put( HEADER_OFFSET, header ); }
+      void set_nonce( uint32_t nonce )          { put( NONCE_OFFSET, nonce ); }
+      void set_user( const user_record& user )
+      {
+         put( USER_OFFSET, user.valid );
+         put( USER_OFFSET + 8, user.invalid );
+         put( USER_OFFSET + 16, user.total_earned );
+         put( USER_OFFSET + 24, user.total_paid );
+      }
+
+   private:
+      template<typename T>
+      void put( uint32_t offset, const T& value )   { memcpy( bytes + offset, &value, sizeof(value) ); }
+      template<typename T>
+      void get( uint32_t offset, T& value )const    { memcpy( &value, bytes + offset, sizeof(value) ); }
+
+      char bytes[SIZE];
+};
+
+static_assert( sizeof(bitcoin::work) == 88, "work_frame copies the header as it is packed" );
+
 #include <fc/reflect/reflect.hpp>
 FC_REFLECT( work_message, 
             (type)